@@ -0,0 +1,468 @@
+// Copyright (c) 2019 Pocketwatch Games, LLC.
+
+// Capture path benchmarks. premake5.lua builds this as TraceBench (TraceBlock_t
+// capture), TraceBenchCompact (TRACE_COMPACT_EVENTS), TraceBenchInline
+// (TRACE_INLINE) and TraceBenchAggregate (TRACE_AGGREGATE) so they can be
+// compared on the same machine.
+//
+// Every workload is fixed size and reports the best of BENCH_RUNS in wall
+// clock ns, less an empty loop of the same length:
+// * flat: one scope per iteration. flat.sampled records 1 in about
+//   BENCH_SAMPLE_PERIOD of them with TraceSetSiteSamplePeriod().
+// * deep: BENCH_DEPTH distinct functions nested in each other.
+// * recursive: one function recursing BENCH_RECURSION deep.
+// * tagged: flat with a TRACE_STATIC_TAG() and with one of BENCH_TAGS runtime tags.
+// * pushpop: __TracePush()/__TracePop() called directly, and the inline
+//   versions next to them in TRACE_INLINE builds. pushpop.elided has every
+//   block dropped by TraceSetSiteElideThreshold() when it pops.
+// * grow: how long the pushes that had to call TraceThreadGrow() stalled.
+// * scale: 1 to BENCH_MAX_THREADS threads running flat at once, each with its
+//   own writer thread.
+// The writer benchmark times how fast the writer threads turn blocks over
+// BENCH_SITES distinct call sites into a trace file with each output
+// backend, and how much CPU the writer threads burn doing it. On POSIX it
+// also compares the cost of reading the two timestamp sources, rdtsc and
+// clock_gettime(CLOCK_MONOTONIC_RAW) (TRACE_CLOCK_MONOTONIC).
+//
+// usage: TraceBench [trace path fragment] [--csv]
+// --csv prints "mode,name,value,unit" lines to diff between builds.
+
+#include "TraceProfiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#define BENCH_SCOPES (256*1024)
+#define BENCH_RUNS 8
+#define BENCH_DEPTH 8 // BenchLevel8() down to BenchLevel1()
+#define BENCH_RECURSION 64
+#define BENCH_TAGS 64
+#define BENCH_GROW_SCOPES (12*1024*1024)
+#define BENCH_SCALE_SCOPES (64*1024)
+#define BENCH_MAX_THREADS 64
+#define BENCH_WRITER_BLOCKS (2*1024*1024)
+#define BENCH_SITES (20*1000)
+#define BENCH_CLOCK_READS (1024*1024)
+#define BENCH_SAMPLE_PERIOD 64
+
+#ifdef TRACE_COMPACT_EVENTS
+#define BENCH_CAPTURE "compact events"
+#elif defined(TRACE_FLIGHT_RECORDER)
+#define BENCH_CAPTURE "flight recorder"
+#elif defined(TRACE_AGGREGATE)
+#define BENCH_CAPTURE "aggregate"
+#else
+#define BENCH_CAPTURE "blocks"
+#endif
+
+#ifdef TRACE_INLINE
+#define BENCH_MODE BENCH_CAPTURE " inline"
+#else
+#define BENCH_MODE BENCH_CAPTURE
+#endif
+
+static volatile int s_sink;
+static bool s_csv;
+static char s_tagNames[BENCH_TAGS][16];
+
+static void BenchReport(const char* name, double value, const char* unit) {
+	if (s_csv) {
+		printf("%s,%s,%.2f,%s\n", BENCH_MODE, name, value, unit);
+	} else {
+		printf("  %-32s %12.1f %s\n", name, value, unit);
+	}
+}
+
+static uint64_t BenchNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t BenchEmpty() {
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		s_sink = i;
+	}
+	return BenchNanos() - start;
+}
+
+// the id of the first site registered with label.
+static uint16_t BenchFindSite(const char* label) {
+	for (int i = 1; i < TraceGetNumSites(); ++i) {
+		if (!strcmp(TraceGetSite((uint16_t)i)->label.str, label)) {
+			return (uint16_t)i;
+		}
+	}
+	return TRACE_SITE_UNREGISTERED;
+}
+
+static uint64_t BenchFlat() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		TRBLOCK("flat");
+		s_sink = i;
+	}
+	return BenchNanos() - start;
+}
+
+// distinct functions so every level is its own call site.
+#define BENCH_LEVEL(_level, _next) static void BenchLevel##_level() { TRACE(); _next; }
+BENCH_LEVEL(1, s_sink = 1)
+BENCH_LEVEL(2, BenchLevel1())
+BENCH_LEVEL(3, BenchLevel2())
+BENCH_LEVEL(4, BenchLevel3())
+BENCH_LEVEL(5, BenchLevel4())
+BENCH_LEVEL(6, BenchLevel5())
+BENCH_LEVEL(7, BenchLevel6())
+BENCH_LEVEL(8, BenchLevel7())
+
+static uint64_t BenchDeep() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES / BENCH_DEPTH; ++i) {
+		BenchLevel8();
+	}
+	return BenchNanos() - start;
+}
+
+static void BenchRecurse(int depth) {
+	TRACE();
+	if (depth > 1) {
+		BenchRecurse(depth - 1);
+	} else {
+		s_sink = depth;
+	}
+}
+
+static uint64_t BenchRecursive() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES / BENCH_RECURSION; ++i) {
+		BenchRecurse(BENCH_RECURSION);
+	}
+	return BenchNanos() - start;
+}
+
+static uint64_t BenchStaticTag() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		TRBLOCK_TAG("tagged", TRACE_STATIC_TAG("static"));
+		s_sink = i;
+	}
+	return BenchNanos() - start;
+}
+
+static uint64_t BenchRuntimeTag() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		const char* tag = s_tagNames[i & (BENCH_TAGS - 1)];
+		TRBLOCK_TAG("tagged", tag);
+		s_sink = i;
+	}
+	return BenchNanos() - start;
+}
+
+static const uint16_t s_pushPopSite = TraceRegisterSite(trace_crcstr_t("pushpop"), trace_crcstr_t(__FILE__ ":" TRACE_STRINGIZE(__LINE__)));
+#define BENCH_PUSH(_fn) _fn(s_pushPopSite, 0, 0)
+
+static uint64_t BenchPushPop() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		BENCH_PUSH(__TracePush);
+		s_sink = i;
+		__TracePop();
+	}
+	return BenchNanos() - start;
+}
+
+#ifdef TRACE_INLINE
+static uint64_t BenchPushPopInline() {
+	TRACE();
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCOPES; ++i) {
+		BENCH_PUSH(__TracePushInline);
+		s_sink = i;
+		__TracePopInline();
+	}
+	return BenchNanos() - start;
+}
+#endif
+
+static double Best(uint64_t (*fn)(), uint64_t baseline) {
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < BENCH_RUNS; ++i) {
+		best = std::min(best, fn());
+		TRACE_WRITEBLOCKS(0);
+	}
+	return (best > baseline) ? (best - baseline) / (double)BENCH_SCOPES : 0.0;
+}
+
+// times every push on its own and sorts out the ones that grew the thread's
+// storage, a new chunk (or committed range, or recycled ring chunk) each.
+static void BenchGrow() {
+	TRACE();
+	uint64_t normalTicks = 0;
+	uint64_t stallTicks = 0;
+	uint64_t stallMax = 0;
+	int stalls = 0;
+
+	const auto nanoStart = BenchNanos();
+	const auto tickStart = TRACE_RDTSC();
+	for (int i = 0; i < BENCH_GROW_SCOPES; ++i) {
+		const auto thread = __tr_thread;
+		const auto maxblocks = thread->maxblocks;
+		const auto start = TRACE_RDTSC();
+		BENCH_PUSH(__TracePush);
+		const auto end = TRACE_RDTSC();
+		__TracePop();
+		if ((__tr_thread != thread) || (__tr_thread->maxblocks != maxblocks)) {
+			++stalls;
+			stallTicks += end - start;
+			stallMax = std::max<uint64_t>(stallMax, end - start);
+		} else {
+			normalTicks += end - start;
+		}
+		if (!(i & 0xffff)) {
+			TRACE_WRITEBLOCKS(0);
+		}
+	}
+	const auto nanosPerTick = (BenchNanos() - nanoStart) / (double)(TRACE_RDTSC() - tickStart);
+
+	BenchReport("grow.stalls", stalls, "stalls");
+	BenchReport("grow.push", normalTicks * nanosPerTick / (BENCH_GROW_SCOPES - stalls), "ns/push");
+	BenchReport("grow.stall", stalls ? stallTicks * nanosPerTick / stalls : 0.0, "ns/stall");
+	BenchReport("grow.stall.max", stallMax * nanosPerTick, "ns");
+}
+
+static std::atomic<int> s_scaleReady;
+static std::atomic<bool> s_scaleGo;
+static std::atomic<uint64_t> s_scaleNanos;
+
+static void BenchScaleThread() {
+	TRTHREADPROC("scale");
+	TRACE();
+	++s_scaleReady;
+	while (!s_scaleGo.load(std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+	const auto start = BenchNanos();
+	for (int i = 0; i < BENCH_SCALE_SCOPES; ++i) {
+		TRBLOCK("flat");
+		s_sink = i;
+	}
+	s_scaleNanos += BenchNanos() - start;
+}
+
+// aggregate scopes/s from when the threads are released to when the last
+// one finishes, and the average cost of a scope on each thread.
+static void BenchScale(const char* path, int numThreads) {
+	char scalePath[1024];
+	snprintf(scalePath, sizeof(scalePath), "%s.scale%02i", path, numThreads);
+#ifndef TRACE_FLIGHT_RECORDER
+	TraceSetWriterThreads(numThreads, 0, 0);
+#endif
+	TraceInit(scalePath);
+
+	s_scaleReady = 0;
+	s_scaleGo = false;
+	s_scaleNanos = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; ++i) {
+		threads.push_back(std::thread(BenchScaleThread));
+	}
+	while (s_scaleReady < numThreads) {
+		std::this_thread::yield();
+	}
+	const auto start = BenchNanos();
+	s_scaleGo.store(true, std::memory_order_release);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	const auto seconds = (BenchNanos() - start) / 1e9;
+	TraceShutdown();
+
+	char name[64];
+	snprintf(name, sizeof(name), "scale.%i.throughput", numThreads);
+	BenchReport(name, (double)numThreads * BENCH_SCALE_SCOPES / seconds / 1e6, "Mscopes/s");
+	snprintf(name, sizeof(name), "scale.%i.scope", numThreads);
+	BenchReport(name, s_scaleNanos / ((double)numThreads * BENCH_SCALE_SCOPES), "ns/scope");
+}
+
+#if !defined(TRACE_FLIGHT_RECORDER) && !defined(TRACE_AGGREGATE)
+static char s_siteNames[BENCH_SITES][32];
+static uint32_t s_writerThreadID;
+
+static void BenchWriterThread() {
+	TRTHREADPROC("writer");
+	s_writerThreadID = TraceGetCurrentThreadID();
+	static uint16_t sites[BENCH_SITES];
+	for (int i = 0; i < BENCH_SITES; ++i) {
+		const trace_crcstr_t name(s_siteNames[i], trace_crc_runtime_tag);
+		sites[i] = TraceRegisterSite(name, name);
+	}
+
+	// pairs of nested blocks so the parent child times get exercised too.
+	for (int i = 0; i < BENCH_WRITER_BLOCKS / 2; ++i) {
+		__TracePush(sites[(i * 7) % BENCH_SITES], 0, 0);
+		__TracePush(sites[(i * 13 + 1) % BENCH_SITES], 0, 0);
+		__TracePop();
+		__TracePop();
+	}
+}
+
+// from the first block captured to the last one written, capture is a
+// small fraction of it.
+static void BenchWriter(const char* path, int output, const char* name) {
+	char writerPath[1024];
+	snprintf(writerPath, sizeof(writerPath), "%s.writer.%s", path, name);
+	TraceSetOutput(output);
+	TraceInit(writerPath);
+
+	const auto cpuStart = TraceGetWriterCpuSeconds();
+	const auto start = std::chrono::steady_clock::now();
+	std::thread thread(BenchWriterThread);
+	thread.join();
+	TraceShutdown();
+	const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const auto cpu = TraceGetWriterCpuSeconds() - cpuStart;
+
+	char tracePath[1100];
+	snprintf(tracePath, sizeof(tracePath), "%s.writer.%u.trace", writerPath, s_writerThreadID);
+	double bytes = 0;
+	if (auto fp = fopen(tracePath, "rb")) {
+		fseek(fp, 0, SEEK_END);
+		bytes = (double)ftell(fp);
+		fclose(fp);
+	}
+
+	char label[64];
+	snprintf(label, sizeof(label), "writer.%s.blocks", name);
+	BenchReport(label, BENCH_WRITER_BLOCKS / seconds, "blocks/s");
+	snprintf(label, sizeof(label), "writer.%s.bytes", name);
+	BenchReport(label, bytes / (1024 * 1024) / seconds, "MB/s");
+	snprintf(label, sizeof(label), "writer.%s.cpu", name);
+	BenchReport(label, cpu * 100 / seconds, "%");
+}
+#endif
+
+#ifndef _WIN32
+static uint64_t BenchReadMonotonic() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t BenchReadTSC() {
+	return __rdtsc();
+}
+#endif
+
+// best of BENCH_RUNS, in wall clock ns per read so the two are comparable.
+static double BenchClock(uint64_t (*fn)()) {
+	double best = 1e30;
+	for (int run = 0; run < BENCH_RUNS; ++run) {
+		uint64_t sum = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < BENCH_CLOCK_READS; ++i) {
+			sum += fn();
+		}
+		const auto nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		s_sink = (int)sum;
+		best = std::min(best, nanos / BENCH_CLOCK_READS);
+	}
+	return best;
+}
+#endif
+
+int main(int argc, char** argv) {
+	const char* path = "TraceBench";
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--csv")) {
+			s_csv = true;
+		} else {
+			path = argv[i];
+		}
+	}
+	for (int i = 0; i < BENCH_TAGS; ++i) {
+		snprintf(s_tagNames[i], sizeof(s_tagNames[i]), "tag%02i", i);
+	}
+
+	if (!s_csv) {
+		printf("TraceBench (%s, %i scopes x %i runs)\n", BENCH_MODE, BENCH_SCOPES, BENCH_RUNS);
+	}
+
+	TraceInit(path);
+	{
+		TRTHREADPROC("bench");
+		TRACE();
+
+		uint64_t baseline = UINT64_MAX;
+		for (int i = 0; i < BENCH_RUNS; ++i) {
+			baseline = std::min(baseline, BenchEmpty());
+		}
+
+		BenchReport("flat", Best(BenchFlat, baseline), "ns/scope");
+		const auto flatSite = BenchFindSite("flat");
+		TraceSetSiteSamplePeriod(flatSite, BENCH_SAMPLE_PERIOD);
+		BenchReport("flat.sampled", Best(BenchFlat, baseline), "ns/scope");
+		TraceSetSiteSamplePeriod(flatSite, 1);
+		BenchReport("deep", Best(BenchDeep, baseline), "ns/scope");
+		BenchReport("recursive", Best(BenchRecursive, baseline), "ns/scope");
+		BenchReport("tagged.static", Best(BenchStaticTag, baseline), "ns/scope");
+		BenchReport("tagged.runtime", Best(BenchRuntimeTag, baseline), "ns/scope");
+		BenchReport("pushpop", Best(BenchPushPop, baseline), "ns/scope");
+#ifdef TRACE_INLINE
+		BenchReport("pushpop.inline", Best(BenchPushPopInline, baseline), "ns/scope");
+#endif
+#if !defined(TRACE_COMPACT_EVENTS) && !defined(TRACE_FLIGHT_RECORDER) && !defined(TRACE_AGGREGATE)
+		TraceSetSiteElideThreshold(s_pushPopSite, 1000000);
+		BenchReport("pushpop.elided", Best(BenchPushPop, baseline), "ns/scope");
+		TraceSetSiteElideThreshold(s_pushPopSite, 0);
+#endif
+		BenchGrow();
+	}
+	TraceShutdown();
+
+#ifndef _WIN32
+#if defined(__x86_64__) || defined(__i386__)
+	BenchReport("clock.rdtsc", BenchClock(BenchReadTSC), "ns/read");
+#endif
+	BenchReport("clock.monotonic_raw", BenchClock(BenchReadMonotonic), "ns/read");
+#endif
+
+#if !defined(TRACE_FLIGHT_RECORDER) && !defined(TRACE_AGGREGATE)
+	// flight recorder builds don't write anything until a snapshot, aggregate
+	// builds never write blocks.
+	for (int i = 0; i < BENCH_SITES; ++i) {
+		snprintf(s_siteNames[i], sizeof(s_siteNames[i]), "site%05i", i);
+	}
+
+	if (!s_csv) {
+		printf("  writer: %i blocks, %i sites\n", BENCH_WRITER_BLOCKS, BENCH_SITES);
+	}
+	BenchWriter(path, TRACE_OUTPUT_STDIO, "stdio");
+	BenchWriter(path, TRACE_OUTPUT_DIRECT, "direct");
+	BenchWriter(path, TRACE_OUTPUT_MMAP, "mmap");
+	TraceSetOutput(TRACE_OUTPUT_STDIO);
+#endif
+
+	for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+		BenchScale(path, threads);
+	}
+	return 0;
+}
@@ -8,17 +8,113 @@
 // Should occupy 16,385*4 pages
 #define TRACE_BLOCK_SIZE (((1024*1024)+45) * 4)
 
+#ifdef TRACE_COMPACT_EVENTS
+// Two events per scope, roughly the same chunk footprint as the block path.
+#define TRACE_RECORD_SIZE (TRACE_BLOCK_SIZE * 4)
+#define TRACE_RECORD_BYTES sizeof(TraceEvent_t)
+#elif defined(TRACE_FLIGHT_RECORDER)
+// Ring chunks are much smaller so the oldest data can be recycled
+// in small steps.
+#ifndef TRACE_FLIGHT_BLOCK_SIZE
+#define TRACE_FLIGHT_BLOCK_SIZE (64*1024)
+#endif
+#define TRACE_RECORD_SIZE TRACE_FLIGHT_BLOCK_SIZE
+#define TRACE_RECORD_BYTES sizeof(TraceBlock_t)
+#elif defined(TRACE_AGGREGATE)
+// Chunks only hold the open scopes, deeper stacks add another chunk.
+#define TRACE_RECORD_SIZE 256
+#define TRACE_RECORD_BYTES sizeof(TraceBlock_t)
+#else
+#define TRACE_RECORD_SIZE TRACE_BLOCK_SIZE
+#define TRACE_RECORD_BYTES sizeof(TraceBlock_t)
+#endif
+
+#define TRACE_RECORD_OFS(_num) (sizeof(TraceThread_t) + TRACE_RECORD_BYTES * ((_num) - 1))
+#define TRACE_CHUNK_BYTES TRACE_RECORD_OFS(TRACE_RECORD_SIZE)
+
+#ifdef TRACE_VIRTUAL_STORAGE
+// Address space reserved for each thread, TRACE_RECORD_SIZE records
+// are committed at a time as the thread fills it.
+#ifndef TRACE_VIRTUAL_RESERVE
+#define TRACE_VIRTUAL_RESERVE (64ull * 1024 * 1024 * 1024)
+#endif
+#define TRACE_VIRTUAL_PAGE (64 * 1024)
+#define TRACE_VIRTUAL_MAX_RECORDS std::min<uint64_t>((TRACE_VIRTUAL_RESERVE - sizeof(TraceThread_t)) / TRACE_RECORD_BYTES, INT32_MAX)
+#endif
+
+// One writer pool services every traced thread. A thread wakes it every
+// TRACE_WRITER_BATCH records it publishes, anything less is picked up
+// every TRACE_WRITER_LATENCY ms.
+#define TRACE_WRITER_THREADS 2
+#define TRACE_WRITER_BATCH (64 * 1024)
+#define TRACE_WRITER_LATENCY 100
+
+// Trace files are written from TRACE_OUTPUT_STAGING byte buffers aligned
+// to TRACE_OUTPUT_ALIGN (the largest sector size unbuffered I/O needs).
+// Memory mapped files grow by at least TRACE_OUTPUT_MAP_GROW at a time.
+#define TRACE_OUTPUT_STAGING (1024 * 1024)
+#define TRACE_OUTPUT_ALIGN 4096
+#define TRACE_OUTPUT_MAP_GROW (64ull * 1024 * 1024)
+
+// Blocks go to the file in segments of up to TRACE_SEGMENT_BLOCKS. A
+// checkpoint that makes them readable follows every TRACE_CHECKPOINT_BLOCKS
+// blocks or TRACE_CHECKPOINT_INTERVAL ms, whichever comes first.
+#define TRACE_SEGMENT_BLOCKS (64 * 1024)
+#define TRACE_CHECKPOINT_BLOCKS (1024 * 1024)
+#define TRACE_CHECKPOINT_INTERVAL 1000
+
+// TraceSetSampling() periods are picked again every TRACE_SAMPLE_INTERVAL ms
+// from the calls the writers added up at their checkpoints since.
+#define TRACE_SAMPLE_INTERVAL 500
+
+#ifdef TRACE_AGGREGATE
+// How often (ms) the reporter adds up the threads' totals and appends them
+// to the aggregate file.
+#ifndef TRACE_AGGREGATE_INTERVAL
+#define TRACE_AGGREGATE_INTERVAL 1000
+#endif
+#endif
+
+// Ticks are paired with the steady clock at least this often (ms), and
+// whenever a file is finished.
+#define TRACE_SYNC_INTERVAL 1000
+
+// Number of distinct tags a process can have, a power of 2, and how many
+// slots a lookup probes before the tag counts as overflowed.
+#define TRACE_TAG_TABLE_SIZE (64 * 1024)
+#define TRACE_TAG_MAX_PROBE 256
+
+#ifdef TRACE_FLIGHT_RECORDER
+// Block numbers are rebased once they get this large so a ring
+// can keep recording forever.
+#define TRACE_FLIGHT_REBASE (1 << 30)
+#define TRACE_FLIGHT_CHUNKS 4
+#define TRACE_FLIGHT_BUDGET (256ull * 1024 * 1024)
+#define TRACE_TRIGGER_PREROLL 10000
+#define TRACE_TRIGGER_POSTROLL 2000
+#endif
+
+// The writer pool writes each thread's blocks as they are published. The
+// flight recorder only writes snapshots and aggregate builds only totals.
+#if !defined(TRACE_FLIGHT_RECORDER) && !defined(TRACE_AGGREGATE)
+#define TRACE_WRITER_POOL
+#endif
+
 #ifdef _MSC_VER
 #pragma warning(push)
 #pragma warning(disable:4365 4548 4774)
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <chrono>
 #include <vector>
 #include <thread>
 #include <algorithm>
 #include <mutex>
+#include <condition_variable>
 
 #if !defined(TRACE_ASSERT) || !defined(TRACE_VERIFY)
 #include <assert.h>
@@ -37,6 +133,11 @@
 #endif
 
 #define TRACE_FOURCC(a, b, c, d) ((uint32_t)(((uint32_t)(a)) + (((uint32_t)(b))<<8) + (((uint32_t)(c))<<16)+ (((uint32_t)(d))<<24)))
+#define TRACE_MAGIC_PACKED_BLOCKS TRACE_FOURCC('B', 'L', 'K', 'P')
+#define TRACE_MAGIC_CHECKPOINT TRACE_FOURCC('C', 'H', 'K', 'P')
+#define TRACE_MAGIC_CONTEXTS TRACE_FOURCC('C', 'T', 'X', 'P')
+#define TRACE_MAGIC_COUNTERS TRACE_FOURCC('C', 'N', 'T', 'P')
+#define TRACE_MAGIC_CHECKPOINT_END TRACE_FOURCC('C', 'E', 'N', 'D')
 
 #ifdef _WIN32
 #ifdef _MSC_VER
@@ -51,6 +152,37 @@
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifndef _MSC_VER
+template <size_t N> static inline int strcpy_s(char (&dst)[N], const char* src) {
+	strncpy(dst, src, N - 1);
+	dst[N - 1] = 0;
+	return 0;
+}
+
+template <size_t N> static inline int sprintf_s(char (&dst)[N], const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	const auto r = vsnprintf(dst, N, fmt, args);
+	va_end(args);
+	return r;
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(TRACE_CLOCK_MONOTONIC)
+#include <cpuid.h>
 #endif
 
 static void trace_vDebugWrite(const char* msg, va_list args) {
@@ -105,425 +237,3422 @@ uint32_t trace_crc_str_32(const char* str) {
 	return (crc ^ 0xFFFFFFFFul);
 }
 
-static constexpr uint64_t INDEX_TIMEBASE_IN_MICROS = 1000 * 1000;
+// TraceRegisterSite() table, sites are only ever added. Registration takes a
+// lock, it happens once per site while the program starts.
+static TraceSite_t s_sites[TRACE_MAX_SITES] = { { trace_crcstr_t(TRACE_SITE_UNREGISTERED_STRING), trace_crcstr_t(TRACE_SITE_UNREGISTERED_STRING), 0 } };
+static uint16_t s_siteHash[TRACE_MAX_SITES * 2]; // site ids by label and location crc, 0 for an empty slot
+static std::atomic<int> s_numSites{ 1 };
+static std::mutex s_siteLock;
+static uint32_t s_categoryMask = 0xffffffffu; // under s_siteLock
+static std::atomic<uint32_t> s_categoryNames[TRACE_MAX_CATEGORIES]; // TraceInternTag() ids, 0 until named
+static uint32_t s_elideTicks; // TraceSetElideThreshold(), under s_siteLock
+// the thresholds as they were set, converted again once the tick rate is
+// calibrated. Under s_siteLock.
+static uint32_t s_elideNanos;
+static uint32_t s_siteElideNanos[TRACE_MAX_SITES];
+static std::atomic<uint32_t> s_samplePeriod[TRACE_MAX_SITES]; // 1 in how many calls TraceSample() records, 0 or 1 for all
+
+std::atomic<uint8_t> __tr_siteDisabled[TRACE_MAX_SITES];
+std::atomic<uint32_t> __tr_siteElideTicks[TRACE_MAX_SITES];
+
+uint16_t TraceRegisterSite(trace_crcstr_t label, trace_crcstr_t location, int category) {
+	TRACE_ASSERT((category >= 0) && (category < TRACE_MAX_CATEGORIES));
+	std::unique_lock<std::mutex> L(s_siteLock);
+	const auto numSites = s_numSites.load(std::memory_order_relaxed);
+	for (uint32_t i = (label.crc * 31) ^ location.crc;; ++i) {
+		auto& slot = s_siteHash[i & (TRACE_MAX_SITES * 2 - 1)];
+		if (!slot) {
+			if (numSites == TRACE_MAX_SITES) {
+				trace_DebugWriteLine("TraceProfiler: the site table is full, [%s] is recorded as \"" TRACE_SITE_UNREGISTERED_STRING "\".", location.str);
+				return TRACE_SITE_UNREGISTERED;
+			}
+			s_sites[numSites].label = label;
+			s_sites[numSites].location = location;
+			s_sites[numSites].category = category;
+			__tr_siteElideTicks[numSites].store(s_elideTicks, std::memory_order_relaxed);
+			s_siteElideNanos[numSites] = s_elideNanos;
+			if (!((s_categoryMask >> category) & 1)) {
+				__tr_siteDisabled[numSites].fetch_or(TRACE_SITE_CATEGORY_DISABLED, std::memory_order_relaxed);
+			}
+			slot = (uint16_t)numSites;
+			s_numSites.store(numSites + 1, std::memory_order_release);
+			return slot;
+		}
+		const auto& site = s_sites[slot];
+		if ((site.label.crc == label.crc) && (site.location.crc == location.crc)) {
+			return slot;
+		}
+	}
+}
+
+int TraceGetNumSites() {
+	return s_numSites.load(std::memory_order_acquire);
+}
+
+const TraceSite_t* TraceGetSite(uint16_t site) {
+	return &s_sites[site];
+}
+
+void TraceSetSiteEnabled(uint16_t site, bool enabled) {
+	if (enabled) {
+		__tr_siteDisabled[site].fetch_and((uint8_t)~TRACE_SITE_DISABLED, std::memory_order_relaxed);
+	} else {
+		__tr_siteDisabled[site].fetch_or(TRACE_SITE_DISABLED, std::memory_order_relaxed);
+	}
+}
+
+int TraceSetSitesEnabled(const char* str, bool enabled) {
+	std::unique_lock<std::mutex> L(s_siteLock);
+	int matched = 0;
+	const auto numSites = s_numSites.load(std::memory_order_relaxed);
+	for (int i = 1; i < numSites; ++i) {
+		const auto& site = s_sites[i];
+		if (!strcmp(site.label.str, str) || !strcmp(site.location.str, str)) {
+			TraceSetSiteEnabled((uint16_t)i, enabled);
+			++matched;
+		}
+	}
+	return matched;
+}
+
+// folded into each site's disabled byte so pushes still check a single byte.
+void TraceSetCategoryMask(uint32_t mask) {
+	std::unique_lock<std::mutex> L(s_siteLock);
+	const auto changed = s_categoryMask ^ mask;
+	s_categoryMask = mask;
+	if (!changed) {
+		return;
+	}
+	const auto numSites = s_numSites.load(std::memory_order_relaxed);
+	for (int i = 1; i < numSites; ++i) {
+		const auto category = s_sites[i].category;
+		if ((changed >> category) & 1) {
+			if ((mask >> category) & 1) {
+				__tr_siteDisabled[i].fetch_and((uint8_t)~TRACE_SITE_CATEGORY_DISABLED, std::memory_order_relaxed);
+			} else {
+				__tr_siteDisabled[i].fetch_or(TRACE_SITE_CATEGORY_DISABLED, std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+uint32_t TraceGetCategoryMask() {
+	std::unique_lock<std::mutex> L(s_siteLock);
+	return s_categoryMask;
+}
+
+// TraceInternTag() table. It has a fixed size so it can be lock free, slots
+// are claimed with a CAS on the crc and never freed.
+struct TraceTagSlot_t {
+	std::atomic<uint32_t> crc;
+	std::atomic<const char*> str; // set once the string has been copied
+};
+
+static TraceTagSlot_t s_tagTable[TRACE_TAG_TABLE_SIZE];
+
+static std::atomic<bool> s_tagOverflow;
+
+uint32_t TraceInternTag(trace_crcstr_t tag) {
+	const auto crc = tag.crc;
+	if (!crc) {
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < TRACE_TAG_MAX_PROBE; ++i) {
+		auto& slot = s_tagTable[(crc + i) & (TRACE_TAG_TABLE_SIZE - 1)];
+		auto cur = slot.crc.load(std::memory_order_acquire);
+		if (!cur && slot.crc.compare_exchange_strong(cur, crc)) {
+			// tags go into a 256 character tagdef_t in the file.
+			const auto len = std::min<size_t>(strlen(tag.str), 255);
+			auto str = (char*)malloc(len + 1);
+			memcpy(str, tag.str, len);
+			str[len] = 0;
+			slot.str.store(str, std::memory_order_release);
+			return crc;
+		} else if (cur == crc) {
+			// the thread that claimed it may still be copying it.
+			while (!slot.str.load(std::memory_order_acquire)) {
+				std::this_thread::yield();
+			}
+			return crc;
+		}
+	}
+
+	if (!s_tagOverflow.exchange(true)) {
+		trace_DebugWriteLine("TraceProfiler: the tag table is full, new tags are recorded as \"" TRACE_TAG_OVERFLOW_STRING "\".");
+	}
+	return TRACE_TAG_OVERFLOW;
+}
+
+static const char* TraceGetTag(uint32_t crc) {
+	if (crc == TRACE_TAG_OVERFLOW) {
+		return TRACE_TAG_OVERFLOW_STRING;
+	}
+	for (uint32_t i = 0; i < TRACE_TAG_MAX_PROBE; ++i) {
+		const auto& slot = s_tagTable[(crc + i) & (TRACE_TAG_TABLE_SIZE - 1)];
+		const auto cur = slot.crc.load(std::memory_order_acquire);
+		if (cur == crc) {
+			return slot.str.load(std::memory_order_acquire);
+		} else if (!cur) {
+			break;
+		}
+	}
+	TRACE_ASSERT(!"tag wasn't interned");
+	return "";
+}
+
+// category names are tags in the file, category 0 is left at 0 (none) until
+// it is named.
+void TraceSetCategoryName(int category, const char* name) {
+	TRACE_ASSERT((category >= 0) && (category < TRACE_MAX_CATEGORIES));
+	s_categoryNames[category].store(TraceInternTag(trace_crcstr_t(name, trace_crc_runtime_tag)), std::memory_order_relaxed);
+}
+
+static uint32_t TraceGetCategoryTag(int category) {
+	auto id = s_categoryNames[category].load(std::memory_order_relaxed);
+	if (!id && category) {
+		char name[32];
+		sprintf_s(name, "category %d", category);
+		id = TraceInternTag(trace_crcstr_t(name, trace_crc_runtime_tag));
+		uint32_t unnamed = 0;
+		if (!s_categoryNames[category].compare_exchange_strong(unnamed, id, std::memory_order_relaxed)) {
+			id = unnamed;
+		}
+	}
+	return id;
+}
+
+// a second or so on current CPUs, it only has to be the same for the whole file.
+static constexpr uint64_t INDEX_TIMEBASE_IN_TICKS = 1ull << 30;
 
 static inline uint64_t GetMicroseconds () {
 	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
 }
 
+static inline uint64_t GetNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 typedef std::unique_lock<std::mutex> LOCK;
 static char s_tracePath[1024];
 static std::mutex M;
-static std::vector<std::thread> s_writeThreads;
-static uint64_t s_microStart;
+static int s_numWriterThreads = TRACE_WRITER_THREADS;
+static uint64_t s_writerAffinity = 0;
+static int s_writerPriority = 0;
+static int s_output = TRACE_OUTPUT_STDIO;
 static uint64_t s_tscStart;
-static uint64_t s_ticksPerMicro;
+static uint64_t s_nanoStart;
+static uint64_t s_ticksPerSecond;
 static bool s_init = false;
 
 THREAD_LOCAL TraceThread_t* __tr_thread;
 
-inline uint64_t GetRelativeMicros(uint64_t tsc) {
-	return ((tsc - s_tscStart) / s_ticksPerMicro);
+inline uint64_t GetRelativeTicks(uint64_t tsc) {
+	return tsc - s_tscStart;
+}
+
+// The invariant TSC rate as the CPU or kernel reports it, 0 if neither does.
+// CPUID leaf 0x15 gives the TSC/crystal ratio and (on most parts) the crystal.
+static uint64_t TraceQueryTicksPerSecond() {
+#ifdef TRACE_CLOCK_MONOTONIC
+	return 1000000000ull;
+#else
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	unsigned int regs[4] = {};
+#ifdef _MSC_VER
+	__cpuid((int*)regs, 0);
+#else
+	__cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	if (regs[0] >= 0x15) {
+#ifdef _MSC_VER
+		__cpuid((int*)regs, 0x15);
+#else
+		__cpuid(0x15, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		if (regs[0] && regs[1] && regs[2]) {
+			return (uint64_t)regs[2] * regs[1] / regs[0];
+		}
+	}
+#endif
+#ifdef __linux__
+	uint64_t khz = 0;
+	if (auto fp = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r")) {
+		if (fscanf(fp, "%llu", (unsigned long long*)&khz) != 1) {
+			khz = 0;
+		}
+		fclose(fp);
+	}
+	return khz * 1000;
+#else
+	return 0;
+#endif
+#endif
+}
+
+#if !defined(TRACE_CLOCK_MONOTONIC) && defined(__linux__)
+// the kernel drops the TSC as its clocksource when it finds it unstable or
+// out of sync between cores, rdtsc timestamps can't be trusted then either.
+static void TraceCheckTSC() {
+	char source[64] = {};
+	if (auto fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r")) {
+		if (!fgets(source, sizeof(source), fp)) {
+			source[0] = 0;
+		}
+		fclose(fp);
+	}
+	if (source[0] && strncmp(source, "tsc", 3)) {
+		trace_DebugWriteLine("Trace: the kernel isn't using the TSC (clocksource %.*s), timestamps may drift between cores. Define TRACE_CLOCK_MONOTONIC to use clock_gettime() instead.", (int)strcspn(source, "\n"), source);
+	}
 }
+#endif
 
 void TraceWriteBlocks(int reset) {
+#ifdef TRACE_AGGREGATE
+	// there are no blocks to write.
+	(void)reset;
+#else
 	auto thread = __tr_thread;
 	if (thread->reset >= reset) {
 		thread->writeblocks.store(thread->numblocks, std::memory_order_release);
+#ifdef TRACE_WRITER_POOL
+		if (thread->numblocks >= thread->notifyblocks) {
+			TraceWakeWriter(thread);
+		}
+#endif
 	}
+#endif
 }
 
-TraceThread_t* TraceThreadGrow() {
-	auto thread = __tr_thread;
+#ifdef TRACE_VIRTUAL_STORAGE
+static void* TraceVirtualReserve(size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	const auto p = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (p != MAP_FAILED) ? p : nullptr;
+#endif
+}
 
-	if (!thread) {
-		thread = (TraceThread_t*)malloc(sizeof(TraceThread_t) + sizeof(TraceBlock_t) * (TRACE_BLOCK_SIZE - 1));
-		thread->prev = nullptr;
-		thread->next = nullptr;
-		thread->reset = 0;
-		thread->blockbase = 0;
-		thread->maxblocks = TRACE_BLOCK_SIZE;
-		thread->writeblocks.store(0, std::memory_order_relaxed);
-		__tr_thread = thread;
-		return thread;
-	}
+// commits the pages covering [from, to) bytes of a reserved range
+static bool TraceVirtualCommit(void* base, size_t from, size_t to) {
+	from &= ~(size_t)(TRACE_VIRTUAL_PAGE - 1);
+	to = std::min<size_t>((to + TRACE_VIRTUAL_PAGE - 1) & ~(size_t)(TRACE_VIRTUAL_PAGE - 1), TRACE_VIRTUAL_RESERVE);
+#ifdef _WIN32
+	return VirtualAlloc((char*)base + from, to - from, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+	return mprotect((char*)base + from, to - from, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
 
-	auto grow = (TraceThread_t*)malloc(sizeof(TraceThread_t) + sizeof(TraceBlock_t) * (TRACE_BLOCK_SIZE - 1));
-	memcpy(grow, thread, sizeof(TraceThread_t));
-	grow->prev = thread;
-	grow->next = nullptr;
-	grow->blockbase = thread->maxblocks;
-	grow->maxblocks = thread->maxblocks + TRACE_BLOCK_SIZE;
+// running out of reserved address space or commit charge can't be recovered
+// from without losing the thread's capture, so say why and stop.
+static void TraceVirtualFail(const char* msg) {
+	trace_DebugWriteLine("Trace: %s", msg);
+	abort();
+}
 
-	thread->next = grow;
-	thread->writeblocks.store(-1, std::memory_order_release);
-		
-	__tr_thread = grow;
+// gives the pages covering [from, to) back, they are never touched again.
+static void TraceVirtualDecommit(void* base, size_t from, size_t to) {
+#ifdef _WIN32
+	VirtualFree((char*)base + from, to - from, MEM_DECOMMIT);
+#else
+	madvise((char*)base + from, to - from, MADV_DONTNEED);
+#endif
+}
 
-	return grow;
+static void TraceVirtualRelease(void* base, size_t size) {
+#ifdef _WIN32
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, size);
+#endif
 }
+#endif
 
-static void UnsortedAddBlockToIndex(int blocknum, uint64_t start, uint64_t end, std::vector<std::vector<int>>& index) {
-	uint64_t start_index = start / INDEX_TIMEBASE_IN_MICROS;
-	uint64_t end_index = end / INDEX_TIMEBASE_IN_MICROS;
+struct TracePinnedBlock_t {
+	int blocknum;
+	bool done; // the writer has fixed it up, dropped on the next release
+	TraceBlock_t block;
+};
+
+// TraceElide() counts of one thread, allocated the first time it elides a
+// block. Only the pages of sites that elide are ever touched.
+struct TraceElided_t {
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> ticks;
+	uint64_t writtenCalls; // what the writer has added to the file so far
+	uint64_t writtenTicks;
+};
+
+struct TraceElidedTable_t {
+	std::atomic<int> numsites;
+	uint16_t sites[TRACE_MAX_SITES]; // in the order they first elided
+	TraceElided_t stats[TRACE_MAX_SITES];
+};
+
+#ifdef TRACE_AGGREGATE
+// TraceAggregate() totals of one site. Calls that TraceSample() skipped
+// calls before are counted again in sampledCalls, with the skipped ones in
+// skippedCalls, like the stack frame stats.
+struct TraceAggregateSum_t {
+	uint64_t calls;
+	uint64_t ticks;
+	uint64_t childTicks;
+	uint64_t minTicks;
+	uint64_t maxTicks;
+	uint64_t sampledCalls;
+	uint64_t sampledTicks;
+	uint64_t skippedCalls;
+};
+
+// the same for one thread, allocated the first time it pops. Only the thread
+// writes them, calls is stored last so the reporter that sees it also sees
+// the rest of the call.
+struct TraceAggregateSite_t {
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> ticks;
+	std::atomic<uint64_t> childTicks;
+	std::atomic<uint64_t> minTicks;
+	std::atomic<uint64_t> maxTicks;
+	std::atomic<uint64_t> sampledCalls;
+	std::atomic<uint64_t> sampledTicks;
+	std::atomic<uint64_t> skippedCalls;
+};
+
+struct TraceAggregateTable_t {
+	std::atomic<int> numsites;
+	uint16_t sites[TRACE_MAX_SITES]; // in the order they were first called
+	TraceAggregateSite_t stats[TRACE_MAX_SITES];
+};
+#endif
 
-	if (index.size() <= end_index) {
-		index.resize(end_index + 1);
+// TraceSample() state of one thread, allocated the first time it samples.
+struct TraceSample_t {
+	uint16_t skipped; // calls skipped since the last recorded one
+	uint16_t gap; // how many to skip before the next one
+};
+
+struct TraceRing_t {
+	~TraceRing_t() {
+		free(elided.load(std::memory_order_relaxed));
+		free(samples);
+#ifdef TRACE_AGGREGATE
+		free(aggregate.load(std::memory_order_relaxed));
+#endif
 	}
 
-	for (auto i = start_index; i <= end_index; ++i) {
-		index[i].push_back(blocknum);
-	}
-}
+	std::mutex lock;
+	TraceThread_t* oldest;
+	// blocks below this are written and the writer won't read them again.
+	std::atomic_int flushed;
+	// blocks the writer wrote unterminated and hasn't fixed up yet, sorted.
+	std::vector<int> unterminated;
+	// blocks still needed whose chunk has been freed, sorted by block number.
+	std::vector<TracePinnedBlock_t> pinned;
+	std::atomic<TraceElidedTable_t*> elided;
+	TraceSample_t* samples; // only the thread touches them
+	uint32_t sampleRandom;
+#ifdef TRACE_AGGREGATE
+	std::atomic<TraceAggregateTable_t*> aggregate;
+#endif
+#ifdef TRACE_FLIGHT_RECORDER
+	TraceThread_t* newest;
+	int numchunks;
+	// set by TraceTrigger(), the ring grows instead of recycling until
+	// the trigger snapshot has been copied.
+	bool hold;
+	// a snapshot is copying the chunks outside the lock, they aren't
+	// recycled, freed or renumbered until it is done.
+	bool copying;
+	char name[256];
+	uint32_t id;
+#endif
+};
 
-static void SortedAddBlockToIndex(int blocknum, uint64_t start, uint64_t end, std::vector<std::vector<int>>& index) {
-	uint64_t start_index = start / INDEX_TIMEBASE_IN_MICROS;
-	uint64_t end_index = end / INDEX_TIMEBASE_IN_MICROS;
+#ifndef TRACE_COMPACT_EVENTS
+static TracePinnedBlock_t* TraceFindPinnedBlock(std::vector<TracePinnedBlock_t>& pinned, int blocknum) {
+	const auto pos = std::lower_bound(pinned.begin(), pinned.end(), blocknum, [](const TracePinnedBlock_t& p, int num) { return p.blocknum < num; });
+	return ((pos != pinned.end()) && (pos->blocknum == blocknum)) ? &*pos : nullptr;
+}
 
-	if (index.size() <= end_index) {
-		index.resize(end_index + 1);
+// only the thread itself writes its counts, calls is stored last so a writer
+// that sees it also sees the ticks that go with it. A sampled block counts
+// the calls it stood in for.
+void TraceElide(TraceThread_t* thread, uint16_t site, uint16_t skipped, uint64_t ticks) {
+	auto ring = thread->ring;
+	auto table = ring->elided.load(std::memory_order_relaxed);
+	if (!table) {
+		table = (TraceElidedTable_t*)calloc(1, sizeof(TraceElidedTable_t));
+		ring->elided.store(table, std::memory_order_release);
 	}
-
-	for (auto i = start_index; i <= end_index; ++i) {
-		const auto pos = std::lower_bound(index[i].begin(), index[i].end(), blocknum);
-		if ((pos == index[i].end()) || (*pos != blocknum)) {
-			index[i].insert(pos, blocknum);
-		}
+	auto& stats = table->stats[site];
+	const auto calls = stats.calls.load(std::memory_order_relaxed);
+	if (!calls) {
+		const auto numsites = table->numsites.load(std::memory_order_relaxed);
+		table->sites[numsites] = site;
+		table->numsites.store(numsites + 1, std::memory_order_release);
 	}
+	stats.ticks.store(stats.ticks.load(std::memory_order_relaxed) + ticks * (skipped + 1u), std::memory_order_relaxed);
+	stats.calls.store(calls + skipped + 1, std::memory_order_release);
 }
+#endif
 
-static void TraceThreadWriter(TraceThread_t* thread) {
-	int curblock = 0;
-	const auto fp = thread->fp;
-	
-	struct {
-		uint32_t magic;
-		uint32_t version;
-		int numstacks;
-		int numtags;
-		int numblocks;
-		int numindexblocks;
-		int maxparents;
-		int padd;
-		uint64_t stackofs;
-		uint64_t tagofs;
-		uint64_t indexofs;
-		uint64_t micro_start;
-		uint64_t micro_end;
-		uint64_t timebase;
-	} header;
-
-	struct block_t {
-		uint64_t start;
-		uint64_t end;
-		uint64_t childTime;
-		uint32_t stackframe;
-		uint32_t tag;
-		int parent;
-		int numparents;
-	};
-
-	struct StackFrame_t {
-		char label[256];
-		char location[256];
-		uint64_t wallTime;
-		uint64_t childTime;
-		uint64_t callCount;
-		uint64_t bestCallTime;
-		uint64_t worstCallTime;
-		int bestcall;
-		int worstcall;
-	};
-
-	struct Tag_t {
-		char string[256];
-	};
-	
-	memset(&header, 0, sizeof(header));
-	fwrite(&header, sizeof(header), 1, fp);
+#ifdef TRACE_AGGREGATE
+static inline void TraceAggregateAdd(std::atomic<uint64_t>& value, uint64_t n) {
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
 
-	std::vector<std::vector<int>> index;
-	std::vector<StackFrame_t> stackFrames;
-	std::vector<Tag_t> tags;
-	std::vector<uint32_t> stackFrameIDs;
-	std::vector<uint32_t> tagIDs;
-	std::vector<int> rewriteBlocks;
-	
-	for (;;) {
-		const auto numblocks = thread->writeblocks.load(std::memory_order_acquire);
-		if (numblocks == -1) {
-			TRACE_ASSERT(thread->next);
-			thread = thread->next;
-			continue;
-		} else if (curblock < numblocks) {
-			const auto count = numblocks - curblock;
+void TraceAggregate(TraceThread_t* thread, const TraceBlock_t* block, uint64_t ticks) {
+	auto ring = thread->ring;
+	auto table = ring->aggregate.load(std::memory_order_relaxed);
+	if (!table) {
+		table = (TraceAggregateTable_t*)calloc(1, sizeof(TraceAggregateTable_t));
+		ring->aggregate.store(table, std::memory_order_release);
+	}
+	auto& stats = table->stats[block->site];
+	const auto calls = stats.calls.load(std::memory_order_relaxed);
+	if (!calls) {
+		const auto numsites = table->numsites.load(std::memory_order_relaxed);
+		table->sites[numsites] = block->site;
+		table->numsites.store(numsites + 1, std::memory_order_release);
+	}
+	TraceAggregateAdd(stats.ticks, ticks);
+	TraceAggregateAdd(stats.childTicks, block->childTime);
+	if (!calls || (ticks < stats.minTicks.load(std::memory_order_relaxed))) {
+		stats.minTicks.store(ticks, std::memory_order_relaxed);
+	}
+	if (ticks > stats.maxTicks.load(std::memory_order_relaxed)) {
+		stats.maxTicks.store(ticks, std::memory_order_relaxed);
+	}
+	if (block->skipped) {
+		TraceAggregateAdd(stats.sampledCalls, 1);
+		TraceAggregateAdd(stats.sampledTicks, ticks);
+		TraceAggregateAdd(stats.skippedCalls, block->skipped);
+	}
+	stats.calls.store(calls + 1, std::memory_order_release);
+}
+#endif
 
-			//trace_DebugWriteLine("--- Begin (%i blocks) ---", count);
-			
-			for (; curblock < numblocks; ++curblock) {
-				const auto* block = TraceGetBlockNum(thread, curblock);
-				block_t file_block;
+#ifndef TRACE_AGGREGATE
+// a counter sample goes into the thread's records like a block but never
+// onto its stack, pops and elides don't see it. Pushes don't publish so
+// neither does this, the flight recorder's snapshots aside.
+static void TraceCounterRecord(uint16_t site, uint64_t value, uint16_t type) {
+	auto thread = __tr_thread;
+	auto index = thread->numblocks;
+#ifdef TRACE_COMPACT_EVENTS
+	if (index + 2 > thread->maxblocks) {
+		thread = TraceThreadGrow();
+		index = thread->numblocks;
+	}
+	auto valueEvent = TraceGetEventNum(thread, index + 1);
+	valueEvent->data = TRACE_EVENT_COUNTER;
+	valueEvent->tsc = value;
+	auto event = TraceGetEventNum(thread, index);
+	event->data = TRACE_EVENT_SITE(site, type) | TRACE_EVENT_COUNTER;
+	event->tsc = TRACE_RDTSC();
+	thread->numblocks = index + 2;
+#else
+	if (index + 1 > thread->maxblocks) {
+		thread = TraceThreadGrow();
+		index = thread->numblocks;
+	}
+	auto block = TraceGetBlockNum(thread, index);
+	block->site = site;
+	block->skipped = type;
+	block->tag = 0;
+	block->parent = TRACE_COUNTER_BLOCK;
+	block->childTime = value;
+	block->start = TRACE_RDTSC();
+	block->end = block->start;
+	thread->numblocks = index + 1;
+	__TRACEPUSHCOMMIT(thread);
+#endif
+}
 
-				file_block.stackframe = block->location.crc;
-				file_block.tag = block->tag ? trace_crc_str_32(block->tag) : 0;
-				file_block.start = GetRelativeMicros(block->start);
-				file_block.end = block->end ? GetRelativeMicros(block->end) : 0;
-				file_block.parent = block->parent;
-				file_block.numparents = 0;
+void TraceCounterInt64(uint16_t site, int64_t value) {
+	TraceCounterRecord(site, (uint64_t)value, TRACE_COUNTER_INT64);
+}
 
-				if (file_block.end) {
-					file_block.childTime = block->childTime;
-				} else {
-					file_block.childTime = 0;
-					// this block is currently unterminated and will not
-					// have correct timing counts in child stack frames.
-					rewriteBlocks.push_back(curblock);
-				}
+void TraceCounterDouble(uint16_t site, double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	TraceCounterRecord(site, bits, TRACE_COUNTER_DOUBLE);
+}
+#endif
 
-				for (auto parent = block->parent; parent != -1; parent = TraceGetBlockNum(thread, parent)->parent) {
-					TRACE_ASSERT(parent < curblock);
-					++file_block.numparents;
-				}
+// The gaps between recorded calls are random with a mean of the period so
+// a site called in a fixed pattern (every entity in turn) doesn't always
+// record the same call. The first call after a site starts being sampled is
+// recorded.
+int TraceSample(uint16_t site) {
+	auto ring = __tr_thread->ring;
+	auto samples = ring->samples;
+	if (!samples) {
+		samples = (TraceSample_t*)calloc(TRACE_MAX_SITES, sizeof(TraceSample_t));
+		ring->samples = samples;
+		ring->sampleRandom = ((uint32_t)(uintptr_t)ring * 2654435761u) | 1;
+	}
+	auto& sample = samples[site];
+	if (sample.skipped < sample.gap) {
+		++sample.skipped;
+		return -1;
+	}
+	const auto skipped = sample.skipped;
+	const auto period = std::max(s_samplePeriod[site].load(std::memory_order_relaxed), 1u);
+	auto x = ring->sampleRandom;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	ring->sampleRandom = x;
+	sample.skipped = 0;
+	sample.gap = (uint16_t)(x % (2 * period - 1));
+	return skipped;
+}
 
-				header.maxparents = std::max(header.maxparents, file_block.numparents);
+static void TraceSetSamplePeriod(int site, uint32_t period) {
+	const auto previous = s_samplePeriod[site].exchange(period, std::memory_order_relaxed);
+	if ((previous > 1) == (period > 1)) {
+		return;
+	}
+	if (period > 1) {
+		__tr_siteDisabled[site].fetch_or(TRACE_SITE_SAMPLED, std::memory_order_relaxed);
+	} else {
+		__tr_siteDisabled[site].fetch_and((uint8_t)~TRACE_SITE_SAMPLED, std::memory_order_relaxed);
+	}
+}
 
-				fwrite(&file_block, sizeof(file_block), 1, fp);
+void TraceSetSiteSamplePeriod(uint16_t site, uint32_t period) {
+	TraceSetSamplePeriod(site, std::min<uint32_t>(std::max(period, 1u), TRACE_MAX_SAMPLE_PERIOD));
+}
 
-				if (file_block.end) {
-					UnsortedAddBlockToIndex(curblock, file_block.start, file_block.end, index);
-				}
+#if !defined(TRACE_COMPACT_EVENTS) && !defined(TRACE_VIRTUAL_STORAGE)
+TraceBlock_t* TraceGetPinnedBlock(TraceThread_t* thread, int blocknum) {
+	auto pinned = TraceFindPinnedBlock(thread->ring->pinned, blocknum);
+	TRACE_ASSERT(pinned);
+	return pinned ? &pinned->block : nullptr;
+}
+#endif
 
-				{
-					const auto pos = std::lower_bound(stackFrameIDs.begin(), stackFrameIDs.end(), file_block.stackframe);
-					if ((pos == stackFrameIDs.end()) || (*pos != file_block.stackframe)) {
-						const auto idx = pos - stackFrameIDs.begin();
-						stackFrameIDs.insert(pos, file_block.stackframe);
-
-						StackFrame_t frame;
-						memset(&frame, 0, sizeof(frame));
-						strcpy_s(frame.label, block->label.str);
-						strcpy_s(frame.location, block->location.str);
-						frame.callCount = 1;
-						frame.wallTime = file_block.end ? file_block.end - file_block.start : 0;
-						frame.bestCallTime = frame.wallTime;
-						frame.worstCallTime = frame.wallTime;
-						frame.bestcall = curblock;
-						frame.worstcall = curblock;
-						stackFrames.insert(idx + stackFrames.begin(), frame);
-					} else {
-						const auto idx = pos - stackFrameIDs.begin();
-						auto& stackFrame = stackFrames[idx];
-						++stackFrame.callCount;
-						if (file_block.end) {
-							const auto wallTime = file_block.end - file_block.start;
-							stackFrame.wallTime += wallTime;
-							if (wallTime < stackFrame.bestCallTime) {
-								stackFrame.bestCallTime = wallTime;
-								stackFrame.bestcall = curblock;
-							}
-							if (wallTime > stackFrame.worstCallTime) {
-								stackFrame.worstCallTime = wallTime;
-								stackFrame.worstcall = curblock;
-							}
-						}
-					}
-				}
+#if !defined(TRACE_VIRTUAL_STORAGE) && !defined(TRACE_FLIGHT_RECORDER)
+// frees the chunks the writer is done with, blocks in them that the
+// writer still has to fix up are pinned until it has.
+static void TraceReleaseChunks(TraceRing_t* ring, TraceThread_t* thread) {
+	const auto flushed = ring->flushed.load(std::memory_order_acquire);
+	if ((ring->oldest == thread) || (ring->oldest->maxblocks > flushed)) {
+		return;
+	}
 
-				if (block->tag) {
-					const auto pos = std::lower_bound(tagIDs.begin(), tagIDs.end(), file_block.tag);
-					if ((pos == tagIDs.end()) || (*pos != file_block.tag)) {
-						const auto idx = pos - tagIDs.begin();
-						tagIDs.insert(pos, file_block.tag);
+	LOCK L(ring->lock);
+#ifndef TRACE_COMPACT_EVENTS
+	auto& pinned = ring->pinned;
+	pinned.erase(std::remove_if(pinned.begin(), pinned.end(), [](const TracePinnedBlock_t& p) { return p.done; }), pinned.end());
+#endif
 
-						Tag_t t;
-						strcpy_s(t.string, block->tag);
-						tags.insert(idx + tags.begin(), t);
-					}
-				}
+	while ((ring->oldest != thread) && (ring->oldest->maxblocks <= flushed)) {
+		auto chunk = ring->oldest;
+#ifndef TRACE_COMPACT_EVENTS
+		const auto& unterminated = ring->unterminated;
+		for (auto pos = std::lower_bound(unterminated.begin(), unterminated.end(), chunk->blockbase); (pos != unterminated.end()) && (*pos < chunk->maxblocks); ++pos) {
+			TracePinnedBlock_t p;
+			p.blocknum = *pos;
+			p.done = false;
+			p.block = chunk->_blocks[*pos - chunk->blockbase];
+			pinned.push_back(p);
+		}
+#endif
+		ring->oldest = chunk->next;
+		ring->oldest->prev = nullptr;
+		free(chunk);
+	}
+}
+#endif
 
-				if (file_block.end) {
-					if (block->parent != -1) {
-						const auto* parentBlock = TraceGetBlockNum(thread, block->parent);
-						const auto stackpos = std::lower_bound(stackFrameIDs.begin(), stackFrameIDs.end(), parentBlock->location.crc);
-						TRACE_ASSERT(stackpos != stackFrameIDs.end());
-						TRACE_ASSERT(*stackpos == parentBlock->location.crc);
-						const auto idx = stackpos - stackFrameIDs.begin();
-						auto& stackFrame = stackFrames[idx];
-						stackFrame.childTime += file_block.end - file_block.start;
-					}
-				}
-			}
+#ifdef TRACE_FLIGHT_RECORDER
+static std::vector<TraceRing_t*> s_rings;
+static int s_flightChunks = TRACE_FLIGHT_CHUNKS;
+static uint64_t s_flightBudget = TRACE_FLIGHT_BUDGET;
+static std::atomic<uint64_t> s_flightBytes(0);
+static std::atomic_int s_snapshotCount(0);
 
-			//trace_DebugWriteLine("--- End (%i blocks) ---", count);
-		} else {
-			if (thread->stack == -2) {
-				break;
-			}
+void TraceSetFlightRecorder(int chunksPerThread, uint64_t budgetBytes) {
+	s_flightChunks = std::max(chunksPerThread, 2);
+	s_flightBudget = budgetBytes;
+}
 
-			//trace_DebugWriteLine("Trace: sleeping.");
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+// claims memory for another chunk if the ring and the global budget allow it.
+static bool TraceFlightReserveChunk(TraceRing_t* ring) {
+	if ((ring->numchunks >= 2) && !ring->copying) {
+		if (!ring->hold && (ring->numchunks >= s_flightChunks)) {
+			return false;
+		}
+		if ((s_flightBytes.fetch_add(TRACE_CHUNK_BYTES) + TRACE_CHUNK_BYTES) > s_flightBudget) {
+			s_flightBytes -= TRACE_CHUNK_BYTES;
+			return false;
 		}
+	} else {
+		s_flightBytes += TRACE_CHUNK_BYTES;
 	}
+	++ring->numchunks;
+	return true;
+}
 
-	const uint64_t stackOfs = ftello64(fp);
-
-	trace_DebugWriteLine("Trace: indexing file [%s]...", thread->path);
-	for (auto& ii : index) {
-		std::sort(ii.begin(), ii.end());
+// unlinks the oldest chunk for reuse, scopes in it that are still
+// open are copied to the pinned table first.
+static TraceThread_t* TraceFlightRecycle(TraceRing_t* ring, TraceThread_t* thread) {
+	auto chunk = ring->oldest;
+	TRACE_ASSERT(chunk != thread);
+
+	auto& pinned = ring->pinned;
+	pinned.erase(std::remove_if(pinned.begin(), pinned.end(), [](const TracePinnedBlock_t& p) { return p.block.end != 0; }), pinned.end());
+
+	const auto first = pinned.size();
+	for (auto blocknum = thread->stack; blocknum >= chunk->blockbase; ) {
+		const auto block = TraceGetBlockNum(thread, blocknum);
+		if (blocknum < chunk->maxblocks) {
+			TracePinnedBlock_t p;
+			p.blocknum = blocknum;
+			p.done = false;
+			p.block = *block;
+			pinned.push_back(p);
+		}
+		blocknum = block->parent;
 	}
-	trace_DebugWriteLine("Rewriting %i block(s)...", (int)rewriteBlocks.size());
-
-	// rewrite blocks!
-	for (const auto blocknum : rewriteBlocks) {
-		const int64_t ofs = sizeof(header) + (blocknum * sizeof(block_t));
-		fseeko64(fp, ofs, SEEK_SET);
-
-		const auto* block = TraceGetBlockNum(thread, blocknum);
-
-		TRACE_ASSERT(block->end);
+	std::reverse(pinned.begin() + first, pinned.end());
 
-		block_t file_block;
-		file_block.stackframe = block->location.crc;
-		file_block.tag = block->tag ? trace_crc_str_32(block->tag) : 0;
-		file_block.start = GetRelativeMicros(block->start);
-		file_block.end = GetRelativeMicros(block->end);
-		file_block.parent = block->parent;
-		file_block.childTime = block->childTime;
-		file_block.numparents = 0;
-		
-		for (auto parent = block->parent; parent != -1; parent = TraceGetBlockNum(thread, parent)->parent) {
-			TRACE_ASSERT(parent < curblock);
-			++file_block.numparents;
-		}
+	ring->oldest = chunk->next;
+	ring->oldest->prev = nullptr;
+	return chunk;
+}
 
-		if (file_block.end) {
-			SortedAddBlockToIndex(blocknum, file_block.start, file_block.end, index);
-
-			const auto pos = std::lower_bound(stackFrameIDs.begin(), stackFrameIDs.end(), file_block.stackframe);
-			TRACE_ASSERT(pos != stackFrameIDs.end());
-			TRACE_ASSERT(*pos == file_block.stackframe);
-
-			{
-				const auto idx = pos - stackFrameIDs.begin();
-				auto& stackFrame = stackFrames[idx];
-				
-				const auto wallTime = file_block.end - file_block.start;
-				stackFrame.wallTime += wallTime;
-				if (wallTime < stackFrame.bestCallTime) {
-					stackFrame.bestCallTime = wallTime;
-					stackFrame.bestcall = curblock;
-				}
-				if (wallTime > stackFrame.worstCallTime) {
-					stackFrame.worstCallTime = wallTime;
-					stackFrame.worstcall = curblock;
-				}
-			}
+// renumbers the pinned blocks from 0 and shifts the resident chunks
+// down behind them. Parents that were recycled become TRACE_DROPPED_BLOCK.
+static void TraceFlightRebase(TraceRing_t* ring, TraceThread_t* thread) {
+	auto& pinned = ring->pinned;
+	const auto base = ring->oldest->blockbase;
+	const auto shift = base - (int)pinned.size();
 
-			if (block->parent != -1 ){
-				const auto* parentBlock = TraceGetBlockNum(thread, block->parent);
-				const auto stackpos = std::lower_bound(stackFrameIDs.begin(), stackFrameIDs.end(), parentBlock->location.crc);
-				TRACE_ASSERT(stackpos != stackFrameIDs.end());
-				TRACE_ASSERT(*stackpos == parentBlock->location.crc);
-				const auto idx = stackpos - stackFrameIDs.begin();
-				auto& stackFrame = stackFrames[idx];
-				stackFrame.childTime += file_block.end - file_block.start;
-			}
+	auto remap = [&](int blocknum) {
+		if ((blocknum < 0) || (blocknum >= base)) {
+			return (blocknum < 0) ? blocknum : blocknum - shift;
 		}
+		const auto p = TraceFindPinnedBlock(pinned, blocknum);
+		return p ? (int)(p - &pinned[0]) : TRACE_DROPPED_BLOCK;
+	};
 
-		fwrite(&file_block, sizeof(file_block), 1, fp);
+	for (auto& p : pinned) {
+		p.block.parent = remap(p.block.parent);
 	}
 
-	fseeko64(fp, stackOfs, SEEK_SET);
-
-	if (stackFrames.size()) {
-		TRACE_VERIFY(stackFrames.size() == stackFrameIDs.size());
-		fwrite(&stackFrameIDs[0], sizeof(stackFrameIDs[0]), stackFrames.size(), fp);
-		fwrite(&stackFrames[0], sizeof(stackFrames[0]), stackFrames.size(), fp);
+	for (auto chunk = ring->oldest; chunk; chunk = chunk->next) {
+		const auto count = std::min(chunk->maxblocks, thread->numblocks) - chunk->blockbase;
+		for (int i = 0; i < count; ++i) {
+			chunk->_blocks[i].parent = remap(chunk->_blocks[i].parent);
+		}
 	}
 
-	const uint64_t tagOfs = ftello64(fp);
+	thread->stack = remap(thread->stack);
+	thread->numblocks -= shift;
 
-	if (tags.size()) {
-		TRACE_VERIFY(tags.size() == tagIDs.size());
-		fwrite(&tagIDs[0], sizeof(tagIDs[0]), tagIDs.size(), fp);
-		fwrite(&tags[0], sizeof(tags[0]), tags.size(), fp);
+	for (int i = 0; i < (int)pinned.size(); ++i) {
+		pinned[i].blocknum = i;
 	}
 
-	const uint64_t indexOfs = ftello64(fp);
-
-	// write index at end of file
-	for (auto& i : index) {
-		int count = (int)i.size();
-		fwrite(&count, sizeof(count), 1, fp);
-		if (count > 0) {
-			fwrite(&i[0], sizeof(i[0]), count, fp);
-		}
+	for (auto chunk = ring->oldest; chunk; chunk = chunk->next) {
+		chunk->blockbase -= shift;
+		chunk->maxblocks -= shift;
 	}
+}
+#endif
 
-	header.magic = TRACE_FOURCC('T', 'R', 'A', 'C');
-	header.version = 2;
-	header.numstacks = (int)stackFrames.size();
-	header.numtags = (int)tags.size();
-	header.numblocks = thread->writeblocks;
-	header.numindexblocks = (int)index.size();
-	header.stackofs = stackOfs;
-	header.tagofs = tagOfs;
-	header.indexofs = indexOfs;
-	header.micro_start = thread->micro_start - s_microStart;
-	header.micro_end = thread->micro_end - s_microStart;
-	header.timebase = INDEX_TIMEBASE_IN_MICROS;
-	fseek(fp, 0, SEEK_SET);
-	fwrite(&header, sizeof(header), 1, fp);
-
-	fclose(fp);
-
-	trace_DebugWriteLine("Trace: wrote %i stack frames to [%s].", header.numblocks, thread->path);
-
+static void TraceFreeThread(TraceThread_t* thread) {
+#ifdef TRACE_VIRTUAL_STORAGE
+	TRACE_ASSERT(!thread->prev);
+	TraceVirtualRelease(thread, TRACE_VIRTUAL_RESERVE);
+#else
 	TraceThread_t* prev = nullptr;
 	for (; thread; thread = prev) {
 		prev = thread->prev;
 		free(thread);
 	}
+#endif
 }
 
-void TraceThreadReset(int reset) {
+TraceThread_t* TraceThreadGrow() {
 	auto thread = __tr_thread;
-	if (thread && (thread->reset < reset) && (thread->blockbase == 0) && (thread->stack >= 0)) {
-		thread->micro_start = GetMicroseconds();
-		thread->micro_end = 0;
+
+	if (!thread) {
+#ifdef TRACE_VIRTUAL_STORAGE
+		const auto maxblocks = (int)std::min<uint64_t>(TRACE_RECORD_SIZE, TRACE_VIRTUAL_MAX_RECORDS);
+		thread = (TraceThread_t*)TraceVirtualReserve(TRACE_VIRTUAL_RESERVE);
+		if (!thread) {
+			TraceVirtualFail("failed to reserve TRACE_VIRTUAL_RESERVE bytes of address space for a thread.");
+		}
+		if (!TraceVirtualCommit(thread, 0, TRACE_RECORD_OFS(maxblocks))) {
+			TraceVirtualFail("failed to commit thread storage.");
+		}
+#else
+		const auto maxblocks = TRACE_RECORD_SIZE;
+		thread = (TraceThread_t*)malloc(TRACE_CHUNK_BYTES);
+#endif
+		thread->prev = nullptr;
+		thread->next = nullptr;
+		thread->reset = 0;
+		thread->blockbase = 0;
+		thread->maxblocks = maxblocks;
+		thread->writeblocks.store(0, std::memory_order_relaxed);
+		thread->ended.store(false, std::memory_order_relaxed);
+		thread->ring = nullptr;
+		__tr_thread = thread;
+		return thread;
+	}
+
+#ifdef TRACE_COMPACT_EVENTS
+	const auto start = TRACE_RDTSC();
+#endif
+
+#ifdef TRACE_VIRTUAL_STORAGE
+	// records stay one flat array, commit the next range in place.
+	const auto maxblocks = (int)std::min<uint64_t>((uint64_t)thread->maxblocks + TRACE_RECORD_SIZE, TRACE_VIRTUAL_MAX_RECORDS);
+	// a push can need room for the grow record and its own (4 compact events).
+	if (maxblocks < (thread->maxblocks + 4)) {
+		TraceVirtualFail("thread storage is full, raise TRACE_VIRTUAL_RESERVE.");
+	}
+	if (!TraceVirtualCommit(thread, TRACE_RECORD_OFS(thread->maxblocks), TRACE_RECORD_OFS(maxblocks))) {
+		TraceVirtualFail("failed to commit thread storage.");
+	}
+	thread->maxblocks = maxblocks;
+
+	auto grow = thread;
+#else
+#ifdef TRACE_FLIGHT_RECORDER
+	auto ring = thread->ring;
+	LOCK L(ring->lock);
+
+	if (!ring->hold && !ring->copying) {
+		// give back what a trigger hold or a snapshot grew beyond the ring size.
+		while (ring->numchunks > std::max(s_flightChunks, 2)) {
+			free(TraceFlightRecycle(ring, thread));
+			--ring->numchunks;
+			s_flightBytes -= TRACE_CHUNK_BYTES;
+		}
+		if ((thread->maxblocks + TRACE_RECORD_SIZE) > TRACE_FLIGHT_REBASE) {
+			TraceFlightRebase(ring, thread);
+		}
+	}
+
+	auto grow = TraceFlightReserveChunk(ring) ? (TraceThread_t*)malloc(TRACE_CHUNK_BYTES) : TraceFlightRecycle(ring, thread);
+	ring->newest = grow;
+#else
+	TraceReleaseChunks(thread->ring, thread);
+	auto grow = (TraceThread_t*)malloc(TRACE_CHUNK_BYTES);
+#endif
+	memcpy(grow, thread, sizeof(TraceThread_t));
+	grow->prev = thread;
+	grow->next = nullptr;
+	grow->blockbase = thread->maxblocks;
+	grow->maxblocks = thread->maxblocks + TRACE_RECORD_SIZE;
+
+	thread->next = grow;
+	thread->writeblocks.store(-1, std::memory_order_release);
+		
+	__tr_thread = grow;
+#endif
+
+#ifdef TRACE_COMPACT_EVENTS
+	{
+		const auto index = grow->numblocks;
+		auto event = TraceGetEventNum(grow, index);
+		event->data = TRACE_EVENT_SITE(TraceSiteRegistration<TraceGrowSite_t>::id, 0);
+		event->tsc = start;
+		event = TraceGetEventNum(grow, index + 1);
+		event->data = TRACE_EVENT_END;
+		event->tsc = TRACE_RDTSC();
+		grow->numblocks = index + 2;
+	}
+#endif
+
+	return grow;
+}
+
+// Version 8 trace files are a header_t followed by segments and are only
+// ever appended to. Blocks go out in BLKP segments (version 3 wrote plain
+// block_t arrays in BLKS segments instead). A CHKP segment makes
+// everything before it readable: it has the stack frames and tags that are
+// new since the previous one, the stats of the stack frames that changed,
+// blocks that closed after they were written unterminated, the blocks that
+// are still open, the new index entries, sync points and the call time
+// histograms of the stack frames that changed. A file that is
+// still being written, or was cut short, can be read up to its last
+// checkpoint.
+//
+// Times are raw TRACE_RDTSC() ticks since TraceInit() (versions 3 and 4
+// stored microseconds). The sync points pair ticks with nanoseconds of
+// steady clock since TraceInit(), readers convert between them piecewise
+// linearly so the tick rate doesn't have to be known up front or stay
+// exactly the same over a long capture.
+struct header_t {
+	uint32_t magic;
+	uint32_t version;
+	int numstacks;
+	int numtags;
+	int numblocks;
+	int numindexblocks;
+	int maxparents;
+	int padd;
+	uint64_t stackofs;
+	uint64_t tagofs;
+	uint64_t indexofs;
+	uint64_t tick_start;
+	uint64_t tick_end;
+	uint64_t timebase; // ticks per index bucket
+};
+
+struct segment_t {
+	uint32_t magic;
+	uint32_t size; // bytes that follow
+};
+
+// Blocks packed as varints, padded to 8 bytes. Each segment decodes on its
+// own, deltas start from 0 at the first block. Per block:
+//   zigzag(start - previous start)
+//   end ? end - start + 1 : 0
+//   childTime
+//   stack frame, the order its stackdef_t was written in
+//   tag ? tag, the order its tagdef_t was written in + 1 : 0
+//   parent >= 0 ? blocknum - parent : 0
+//   zigzag(numparents - previous numparents)
+struct packedsegment_t {
+	int firstblock;
+	int numblocks;
+	uint32_t bytes;
+	int padd;
+	// uint8_t[bytes]
+};
+
+// The calling context tree, a node for every path of stack frames blocks
+// were called through with the calls and time under it. Blocks whose parent
+// wasn't written start a path of their own. Comes right before a checkpoint
+// when nodes were added or changed and is only valid with it (version 9).
+// Varints, padded to 8 bytes:
+//   per new node: parent >= 0 ? parent + 1 : 0, stack frame the order its
+//   stackdef_t was written in
+//   per changed node: node - previous changed node (from 0), callCount,
+//   wallTime, childTime, totals so far
+struct contextsegment_t {
+	int firstnode; // the first new node
+	int numnodes; // new
+	int numchanged;
+	uint32_t bytes;
+	// uint8_t[bytes]
+};
+
+// TRACE_COUNTER() samples, written like the block segments and only valid
+// once a checkpoint follows them (version 10). Each one starts with the
+// counterdef_t of the counters first sampled in it, then varints padded to
+// 8 bytes that decode on their own, per sample:
+//   counter, the order its counterdef_t was written in
+//   zigzag(tick - previous tick), from 0
+//   TRACE_COUNTER_INT64: zigzag(value - the counter's previous value), from 0
+//   TRACE_COUNTER_DOUBLE: the value's bits xor the counter's previous ones
+// A thread's samples are in time order, tick_start and tick_end are the time
+// index that lets a reader skip segments.
+struct countersegment_t {
+	int numcounters;
+	int numsamples;
+	uint32_t bytes;
+	int padd;
+	uint64_t tick_start;
+	uint64_t tick_end;
+	// counterdef_t[numcounters], uint8_t[bytes]
+};
+
+struct counterdef_t {
+	uint32_t id; // crc of the location, like stackdef_t
+	uint32_t category; // tagdef_t id of the category name, 0 for none
+	uint32_t type; // TRACE_COUNTER_INT64 or TRACE_COUNTER_DOUBLE
+	int padd;
+	char label[256];
+	char location[256];
+};
+
+struct block_t {
+	uint64_t start;
+	uint64_t end;
+	uint64_t childTime;
+	uint32_t stackframe;
+	uint32_t tag;
+	int parent;
+	int numparents;
+};
+
+struct checkpoint_t {
+	int numblocks; // blocks in the segments before it
+	int maxparents;
+	int numstacks;
+	int numstackstats;
+	int numtags;
+	int numpatches;
+	int numopen;
+	int numindices;
+	uint64_t tick_start;
+	uint64_t tick_end;
+	int final; // nothing follows it
+	uint32_t indexbytes;
+	int numsyncs;
+	uint32_t latencybytes; // version 8
+	// stackdef_t[numstacks], stackstats_t[numstackstats], tagdef_t[numtags],
+	// patch_t[numpatches], int open[numopen] padded to 8 bytes,
+	// uint8_t index[indexbytes] padded to 8 bytes, syncpoint_t[numsyncs],
+	// uint8_t latency[latencybytes] padded to 8 bytes, checkpointend_t
+};
+
+// new since the previous checkpoint, every file has all of them.
+struct syncpoint_t {
+	uint64_t tick;
+	uint64_t nanos;
+};
+
+// (tick, steady clock) pairs, one from TraceInit() and then one every
+// TRACE_SYNC_INTERVAL ms or so taken by the writers.
+static std::mutex s_syncLock;
+static std::vector<syncpoint_t> s_syncPoints;
+
+static void TraceAddSyncPoint() {
+	syncpoint_t sync;
+	sync.tick = GetRelativeTicks(TRACE_RDTSC());
+	sync.nanos = GetNanoseconds() - s_nanoStart;
+	s_syncPoints.push_back(sync);
+}
+
+static uint32_t TraceNanosToTicks(uint32_t nanos, uint64_t ticksPerMilli) {
+	return (uint32_t)std::min<uint64_t>((uint64_t)nanos * ticksPerMilli / 1000000, UINT32_MAX);
+}
+
+static void TraceConvertElideThresholds(uint64_t ticksPerMilli) {
+	std::unique_lock<std::mutex> L(s_siteLock);
+	s_elideTicks = TraceNanosToTicks(s_elideNanos, ticksPerMilli);
+	for (int i = 0; i < TRACE_MAX_SITES; ++i) {
+		__tr_siteElideTicks[i].store(TraceNanosToTicks(s_siteElideNanos[i], ticksPerMilli), std::memory_order_relaxed);
+	}
+}
+
+// Without a reported rate it is measured against the sync point from
+// TraceInit(), in double since hours of ticks times a million don't fit in
+// 64 bits. Kept once the measurement spans TRACE_SYNC_INTERVAL ms, the
+// writers ask at every checkpoint. The elide thresholds set before then
+// were converted with a rougher rate, or none right after TraceInit().
+static std::atomic<uint64_t> s_calibratedTicksPerMilli{ 0 };
+
+static uint64_t TraceTicksPerMilli() {
+	if (s_ticksPerSecond) {
+		return s_ticksPerSecond / 1000;
+	}
+	uint64_t ticksPerMilli;
+	{
+		LOCK L(s_syncLock);
+		const auto calibrated = s_calibratedTicksPerMilli.load(std::memory_order_relaxed);
+		if (calibrated || s_syncPoints.empty()) {
+			return calibrated;
+		}
+		const auto& first = s_syncPoints.front();
+		const auto tick = GetRelativeTicks(TRACE_RDTSC());
+		const auto nanos = GetNanoseconds() - s_nanoStart;
+		if (nanos <= first.nanos) {
+			return 0;
+		}
+		ticksPerMilli = (uint64_t)((tick - first.tick) * 1000000.0 / (nanos - first.nanos));
+		if ((nanos - first.nanos) < (TRACE_SYNC_INTERVAL * 1000000ull)) {
+			return ticksPerMilli;
+		}
+		s_calibratedTicksPerMilli.store(ticksPerMilli, std::memory_order_relaxed);
+	}
+	TraceConvertElideThresholds(ticksPerMilli);
+	return ticksPerMilli;
+}
+
+// a calibration that lands after TraceTicksPerMilli() converts again once it
+// gets the lock, one that landed before is picked up here.
+static uint32_t TraceElideTicks(uint32_t nanos, uint64_t ticksPerMilli) {
+	const auto calibrated = s_calibratedTicksPerMilli.load(std::memory_order_relaxed);
+	return TraceNanosToTicks(nanos, calibrated ? calibrated : ticksPerMilli);
+}
+
+void TraceSetElideThreshold(uint32_t nanos) {
+	const auto ticksPerMilli = TraceTicksPerMilli();
+	std::unique_lock<std::mutex> L(s_siteLock);
+	const auto ticks = TraceElideTicks(nanos, ticksPerMilli);
+	s_elideNanos = nanos;
+	s_elideTicks = ticks;
+	for (int i = 0; i < TRACE_MAX_SITES; ++i) {
+		s_siteElideNanos[i] = nanos;
+		__tr_siteElideTicks[i].store(ticks, std::memory_order_relaxed);
+	}
+}
+
+void TraceSetSiteElideThreshold(uint16_t site, uint32_t nanos) {
+	const auto ticksPerMilli = TraceTicksPerMilli();
+	std::unique_lock<std::mutex> L(s_siteLock);
+	s_siteElideNanos[site] = nanos;
+	__tr_siteElideTicks[site].store(TraceElideTicks(nanos, ticksPerMilli), std::memory_order_relaxed);
+}
+
+struct stackdef_t {
+	uint32_t id;
+	uint32_t category; // tagdef_t id of the category name, 0 for none
+	char label[256];
+	char location[256];
+};
+
+struct stackstats_t {
+	uint32_t id;
+	int bestcall; // -1 until a call was recorded
+	int worstcall;
+	int padd;
+	uint64_t wallTime;
+	uint64_t childTime;
+	uint64_t callCount; // elided calls included
+	uint64_t bestCallTime;
+	uint64_t worstCallTime;
+	uint64_t elidedCalls; // version 6
+	// version 7, calls recorded 1 in (skippedCalls + sampledCalls) /
+	// sampledCalls by TraceSetSampling(). Their time scaled by that is an
+	// estimate of the time of all of them.
+	uint64_t sampledCalls;
+	uint64_t sampledTime;
+	uint64_t skippedCalls;
+};
+
+// Recorded call times of a stack frame go into log buckets like an HDR
+// histogram: under TRACE_LATENCY_SUB ticks every time has its own bucket,
+// above that every power of two is split into TRACE_LATENCY_SUB buckets, so
+// a bucket is within 1/TRACE_LATENCY_SUB of the times in it. Elided and
+// skipped calls aren't in it. Writers only keep the range of buckets a stack
+// frame has used, and its TRACE_SLOWEST_CALLS slowest blocks.
+#define TRACE_LATENCY_SUB_BITS 4
+#define TRACE_LATENCY_SUB (1 << TRACE_LATENCY_SUB_BITS)
+#define TRACE_SLOWEST_CALLS 16
+#define TRACE_LATENCY_PENDING 8
+
+// the latency of every stackstats_t in a checkpoint, in the same order,
+// packed as varints:
+//   number of slowest calls, then blocknum, time for each, slowest first
+//   number of buckets used, then bucket - previous bucket (from 0), calls
+// for each in bucket order
+struct TraceSlowCall_t {
+	uint64_t time;
+	int blocknum;
+	int padd;
+};
+
+struct TraceLatency_t {
+	TraceLatency_t() : firstbucket(0), numslowest(0) {}
+
+	std::vector<uint64_t> buckets; // calls from firstbucket on
+	int firstbucket;
+	int numslowest;
+	TraceSlowCall_t slowest[TRACE_SLOWEST_CALLS]; // a heap, fastest first
+};
+
+static inline int TraceLatencyBucket(uint64_t ticks) {
+	if (ticks < TRACE_LATENCY_SUB) {
+		return (int)ticks;
+	}
+#ifdef _MSC_VER
+	unsigned long top;
+	_BitScanReverse64(&top, ticks);
+#else
+	const auto top = 63 - __builtin_clzll(ticks);
+#endif
+	const auto shift = (int)top - TRACE_LATENCY_SUB_BITS;
+	return ((shift + 1) << TRACE_LATENCY_SUB_BITS) + (int)((ticks >> shift) & (TRACE_LATENCY_SUB - 1));
+}
+
+struct tagdef_t {
+	uint32_t id;
+	int padd;
+	char string[256];
+};
+
+struct patch_t {
+	int blocknum;
+	int padd;
+	block_t block;
+};
+
+// packed as zigzag(index - previous index), zigzag(blocknum - previous
+// blocknum) varint pairs starting from 0.
+struct indexentry_t {
+	int index; // INDEX_TIMEBASE_IN_TICKS bucket
+	int blocknum;
+};
+
+// a checkpoint is only valid if it ends with this.
+struct checkpointend_t {
+	uint32_t magic;
+	int numblocks;
+};
+
+struct StackFrame_t {
+	char label[256];
+	char location[256];
+	uint64_t wallTime;
+	uint64_t childTime;
+	uint64_t callCount;
+	uint64_t bestCallTime;
+	uint64_t worstCallTime;
+	uint64_t elidedCalls;
+	uint64_t sampledCalls;
+	uint64_t sampledTime;
+	uint64_t skippedCalls;
+	int bestcall;
+	int worstcall;
+	// call times batched up for the histogram in TraceLatency_t, which is
+	// usually not in cache, and how long a call has to take to be one of the
+	// slowest.
+	int numpending;
+	uint64_t pending[TRACE_LATENCY_PENDING];
+	uint64_t slowestTime;
+};
+
+struct TraceContext_t {
+	int parent; // -1 for a root
+	int stackframe;
+	uint64_t callCount;
+	uint64_t wallTime;
+	uint64_t childTime;
+	bool changed;
+};
+
+struct TraceCounterSample_t {
+	uint64_t tick;
+	uint64_t value;
+	int counter;
+	int padd;
+};
+
+// Open addressing table from a crc to where it is in the writer's arrays.
+struct TraceCrcTable_t {
+	struct Slot_t {
+		uint32_t crc;
+		int index; // -1 for an empty slot
+	};
+	TraceCrcTable_t() : count(0) {}
+
+	std::vector<Slot_t> slots;
+	int count;
+};
+
+static inline size_t TraceCrcSlot(uint32_t crc, size_t mask) {
+	return (size_t)(crc * 2654435761u) & mask;
+}
+
+static int TraceCrcFind(const TraceCrcTable_t& table, uint32_t crc) {
+	if (table.slots.empty()) {
+		return -1;
+	}
+	const auto mask = table.slots.size() - 1;
+	for (auto i = TraceCrcSlot(crc, mask);; i = (i + 1) & mask) {
+		const auto& slot = table.slots[i];
+		if (slot.index < 0) {
+			return -1;
+		} else if (slot.crc == crc) {
+			return slot.index;
+		}
+	}
+}
+
+static void TraceCrcInsert(TraceCrcTable_t& table, uint32_t crc, int index) {
+	// keep it at most half full.
+	if (((size_t)table.count + 1) * 2 > table.slots.size()) {
+		std::vector<TraceCrcTable_t::Slot_t> slots(std::max<size_t>(table.slots.size() * 2, 256));
+		for (auto& slot : slots) {
+			slot.index = -1;
+		}
+		table.slots.swap(slots);
+		table.count = 0;
+		for (const auto& slot : slots) {
+			if (slot.index >= 0) {
+				TraceCrcInsert(table, slot.crc, slot.index);
+			}
+		}
+	}
+
+	const auto mask = table.slots.size() - 1;
+	auto i = TraceCrcSlot(crc, mask);
+	while (table.slots[i].index >= 0) {
+		i = (i + 1) & mask;
+	}
+	table.slots[i].crc = crc;
+	table.slots[i].index = index;
+	++table.count;
+}
+
+// A trace file being written, only ever appended to. Records are copied to
+// an aligned staging buffer that goes to disk TRACE_OUTPUT_STAGING bytes at
+// a time (mmap outputs copy straight into the mapping).
+struct TraceOutput_t {
+	int backend;
+	uint64_t base; // file offset of staging[0], the end of the file for mmap
+	size_t used;
+	char* staging;
+	FILE* fp;
+	char* map;
+	uint64_t mapsize;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+static void* TraceAlignedAlloc(size_t size) {
+#ifdef _WIN32
+	return _aligned_malloc(size, TRACE_OUTPUT_ALIGN);
+#else
+	void* p;
+	return posix_memalign(&p, TRACE_OUTPUT_ALIGN, size) ? nullptr : p;
+#endif
+}
+
+static void TraceAlignedFree(void* p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static bool TraceOutputOpenFile(TraceOutput_t& out, const char* path, bool direct) {
+#ifdef _WIN32
+	out.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, direct ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL, nullptr);
+	return out.file != INVALID_HANDLE_VALUE;
+#else
+	auto flags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	if (direct) {
+		flags |= O_DIRECT;
+	}
+#elif !defined(F_NOCACHE)
+	if (direct) {
+		return false;
+	}
+#endif
+	out.fd = open(path, flags, 0644);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+	if (direct && (out.fd >= 0)) {
+		fcntl(out.fd, F_NOCACHE, 1);
+	}
+#endif
+	return out.fd >= 0;
+#endif
+}
+
+static void TraceOutputCloseFile(TraceOutput_t& out, uint64_t size) {
+#ifdef _WIN32
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)size;
+	SetFilePointerEx(out.file, end, nullptr, FILE_BEGIN);
+	SetEndOfFile(out.file);
+	CloseHandle(out.file);
+#else
+	if (ftruncate(out.fd, (off_t)size)) {
+		trace_DebugWriteLine("Trace: failed to truncate trace file.");
+	}
+	close(out.fd);
+#endif
+}
+
+static void TraceOutputWriteFile(TraceOutput_t& out, uint64_t ofs, const void* data, size_t size) {
+#ifdef _WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)ofs;
+	ov.OffsetHigh = (DWORD)(ofs >> 32);
+	DWORD written;
+	if (!WriteFile(out.file, data, (DWORD)size, &written, &ov) || (written != size)) {
+		trace_DebugWriteLine("Trace: failed to write trace file.");
+	}
+#else
+	for (auto p = (const char*)data; size > 0;) {
+		const auto n = pwrite(out.fd, p, size, (off_t)ofs);
+		if (n <= 0) {
+			trace_DebugWriteLine("Trace: failed to write trace file.");
+			break;
+		}
+		p += n;
+		ofs += (uint64_t)n;
+		size -= (size_t)n;
+	}
+#endif
+}
+
+static void TraceOutputUnmap(TraceOutput_t& out) {
+	if (out.map) {
+#ifdef _WIN32
+		UnmapViewOfFile(out.map);
+		CloseHandle(out.mapping);
+#else
+		munmap(out.map, (size_t)out.mapsize);
+#endif
+		out.map = nullptr;
+	}
+}
+
+// (re)maps the file at size bytes, growing it.
+static bool TraceOutputMap(TraceOutput_t& out, uint64_t size) {
+	TraceOutputUnmap(out);
+#ifdef _WIN32
+	out.mapping = CreateFileMappingA(out.file, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, nullptr);
+	if (out.mapping) {
+		out.map = (char*)MapViewOfFile(out.mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+		if (!out.map) {
+			CloseHandle(out.mapping);
+		}
+	}
+#else
+	if (!ftruncate(out.fd, (off_t)size)) {
+		const auto p = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+		out.map = (p != MAP_FAILED) ? (char*)p : nullptr;
+	}
+#endif
+	out.mapsize = out.map ? size : 0;
+	return out.map != nullptr;
+}
+
+static bool TraceOutputOpen(TraceOutput_t& out, const char* path, int backend) {
+	memset(&out, 0, sizeof(out));
+	out.backend = backend;
+
+	if (backend != TRACE_OUTPUT_STDIO) {
+		if (!TraceOutputOpenFile(out, path, backend == TRACE_OUTPUT_DIRECT)) {
+			out.backend = TRACE_OUTPUT_STDIO;
+		} else if ((backend == TRACE_OUTPUT_MMAP) && !TraceOutputMap(out, TRACE_OUTPUT_MAP_GROW)) {
+			TraceOutputCloseFile(out, 0);
+			out.backend = TRACE_OUTPUT_STDIO;
+		}
+		if (out.backend == TRACE_OUTPUT_STDIO) {
+			trace_DebugWriteLine("Trace: output %i isn't available for [%s], using stdio.", backend, path);
+		}
+	}
+
+	if (out.backend == TRACE_OUTPUT_STDIO) {
+#ifdef _WIN32
+		if (fopen_s(&out.fp, path, "wb")) {
+			out.fp = nullptr;
+		}
+#else
+		out.fp = fopen(path, "wb");
+#endif
+		if (!out.fp) {
+			return false;
+		}
+		// it only ever sees whole staging buffers.
+		setvbuf(out.fp, nullptr, _IONBF, 0);
+	}
+
+	if (out.backend != TRACE_OUTPUT_MMAP) {
+		out.staging = (char*)TraceAlignedAlloc(TRACE_OUTPUT_STAGING);
+	}
+	return true;
+}
+
+static uint64_t TraceOutputTell(const TraceOutput_t& out) {
+	return out.base + out.used;
+}
+
+static void TraceOutputFlush(TraceOutput_t& out) {
+	if (out.backend == TRACE_OUTPUT_DIRECT) {
+		// only the end of the file isn't a whole number of sectors, it is
+		// padded here and truncated when the file is closed (or written
+		// again by the next flush after a TraceOutputSync()).
+		const auto size = (out.used + TRACE_OUTPUT_ALIGN - 1) & ~(size_t)(TRACE_OUTPUT_ALIGN - 1);
+		memset(out.staging + out.used, 0, size - out.used);
+		TraceOutputWriteFile(out, out.base, out.staging, size);
+	} else {
+		fwrite(out.staging, 1, out.used, out.fp);
+	}
+	out.base += out.used;
+	out.used = 0;
+}
+
+static void TraceOutputWrite(TraceOutput_t& out, const void* data, size_t size) {
+	if (out.backend == TRACE_OUTPUT_MMAP) {
+		if ((out.base + size <= out.mapsize) || TraceOutputMap(out, std::max<uint64_t>(out.mapsize * 2, out.base + size + TRACE_OUTPUT_MAP_GROW))) {
+			memcpy(out.map + out.base, data, size);
+			out.base += size;
+			return;
+		}
+		// out of address space or disk, what's mapped so far is in the file
+		// already. The rest is staged and written like a direct output (on
+		// a file opened without O_DIRECT), the padding is truncated on close.
+		trace_DebugWriteLine("Trace: failed to grow the mapped trace file, writing it without mmap.");
+		out.backend = TRACE_OUTPUT_DIRECT;
+		out.staging = (char*)TraceAlignedAlloc(TRACE_OUTPUT_STAGING);
+	}
+
+	auto src = (const char*)data;
+	while (size > 0) {
+		const auto n = std::min(size, TRACE_OUTPUT_STAGING - out.used);
+		memcpy(out.staging + out.used, src, n);
+		out.used += n;
+		src += n;
+		size -= n;
+		if (out.used == TRACE_OUTPUT_STAGING) {
+			TraceOutputFlush(out);
+		}
+	}
+}
+
+// gets everything written so far into the file so readers can see it.
+static void TraceOutputSync(TraceOutput_t& out) {
+	if ((out.backend == TRACE_OUTPUT_MMAP) || (out.used == 0)) {
+		return;
+	}
+
+	if (out.backend == TRACE_OUTPUT_DIRECT) {
+		// the partial sector at the end stays staged so writes stay aligned.
+		const auto used = out.used;
+		const auto whole = used & ~(size_t)(TRACE_OUTPUT_ALIGN - 1);
+		TraceOutputFlush(out);
+		out.base -= used - whole;
+		out.used = used - whole;
+		memmove(out.staging, out.staging + whole, out.used);
+	} else {
+		TraceOutputFlush(out);
+	}
+}
+
+static void TraceOutputClose(TraceOutput_t& out) {
+	const auto size = TraceOutputTell(out);
+	if (out.used > 0) {
+		TraceOutputFlush(out);
+	}
+
+	if (out.backend == TRACE_OUTPUT_STDIO) {
+		fclose(out.fp);
+	} else {
+		TraceOutputUnmap(out);
+		TraceOutputCloseFile(out, size);
+	}
+
+	TraceAlignedFree(out.staging);
+	out.staging = nullptr;
+}
+
+// stack frames and tags are kept in the order they are first seen, the
+// reader sorts them.
+struct TraceWriter_t {
+	TraceOutput_t out;
+	std::vector<StackFrame_t> stackFrames;
+	std::vector<TraceLatency_t> latencies; // per stack frame
+	std::vector<uint32_t> stackFrameIDs;
+	std::vector<uint32_t> stackFrameCategories;
+#ifndef TRACE_FLIGHT_RECORDER
+	// TraceAddSiteCalls() state, the calls and rate it last counted per
+	// stack frame and the start of the last block then.
+	std::vector<uint16_t> stackFrameSites;
+	std::vector<uint64_t> stackFrameCalls;
+	std::vector<uint64_t> stackFrameRates;
+	uint64_t sampleTick;
+#endif
+	std::vector<uint32_t> tagIDs;
+	TraceCrcTable_t stackFrameTable;
+	TraceCrcTable_t tagTable;
+	uint64_t tick_start;
+	uint64_t lastTick; // start of the last block written
+	int numblocks;
+	int maxparents;
+	std::vector<int> open; // blocks written with end == 0 that haven't been rewritten yet, sorted
+	std::vector<int> openContexts; // the context of each of them
+
+	// the calling context tree and the path to the last block written,
+	// blocks come in blocknum order so a block's parent is on it if it was
+	// written.
+	struct ContextPath_t {
+		int blocknum;
+		int context;
+	};
+	std::vector<TraceContext_t> contexts;
+	TraceCrcTable_t contextTable; // by stack frame crc and parent
+	std::vector<ContextPath_t> contextPath;
+
+	// what goes into the next segment or checkpoint.
+	std::vector<block_t> blocks; // numblocks - blocks.size() onwards
+	std::vector<patch_t> patches;
+	std::vector<int> changed; // stack frames whose stats changed
+	std::vector<bool> isChanged;
+	std::vector<indexentry_t> index;
+	std::vector<uint8_t> packed;
+	std::vector<uint8_t> packedLatency;
+	std::vector<int> changedContexts;
+	std::vector<syncpoint_t> syncs;
+
+	// counters in the order they were first sampled, the samples that go
+	// into the next counter segment.
+	std::vector<const TraceSite_t*> counterSites;
+	std::vector<uint16_t> counterTypes;
+	std::vector<uint64_t> counterValues; // previous value while packing
+	TraceCrcTable_t counterTable;
+	std::vector<TraceCounterSample_t> samples;
+	int numcountersWritten;
+	int numsamples; // written to the file or in samples
+	int numstacksWritten;
+	int numcontextsWritten;
+	int numtagsWritten;
+	int numsyncsWritten;
+	int checkpointBlocks;
+	uint64_t checkpointMicros;
+};
+
+static bool BeginTraceFile(TraceWriter_t& writer, const char* path, uint64_t tick_start) {
+	if (!TraceOutputOpen(writer.out, path, s_output)) {
+		return false;
+	}
+
+	header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = TRACE_FOURCC('T', 'R', 'A', 'C');
+	header.version = 10;
+	header.tick_start = tick_start;
+	header.timebase = INDEX_TIMEBASE_IN_TICKS;
+	TraceOutputWrite(writer.out, &header, sizeof(header));
+
+	writer.tick_start = tick_start;
+	writer.lastTick = tick_start;
+#ifndef TRACE_FLIGHT_RECORDER
+	writer.sampleTick = tick_start;
+#endif
+	writer.numblocks = 0;
+	writer.maxparents = 0;
+	writer.numstacksWritten = 0;
+	writer.numcontextsWritten = 0;
+	writer.numcountersWritten = 0;
+	writer.numsamples = 0;
+	writer.numtagsWritten = 0;
+	writer.numsyncsWritten = 0;
+	writer.checkpointBlocks = 0;
+	writer.checkpointMicros = GetMicroseconds();
+	return true;
+}
+
+static StackFrame_t& ChangeStackFrame(TraceWriter_t& writer, int idx) {
+	if (!writer.isChanged[idx]) {
+		writer.isChanged[idx] = true;
+		writer.changed.push_back(idx);
+	}
+	return writer.stackFrames[idx];
+}
+
+// adds the stack frame's pending call times to its histogram.
+static void AddPendingLatency(TraceWriter_t& writer, int idx) {
+	auto& stackFrame = writer.stackFrames[idx];
+	auto& latency = writer.latencies[idx];
+	auto& buckets = latency.buckets;
+	for (int i = 0; i < stackFrame.numpending; ++i) {
+		const auto bucket = TraceLatencyBucket(stackFrame.pending[i]);
+		if (buckets.empty()) {
+			latency.firstbucket = bucket;
+		} else if (bucket < latency.firstbucket) {
+			buckets.insert(buckets.begin(), latency.firstbucket - bucket, 0);
+			latency.firstbucket = bucket;
+		}
+		const auto j = bucket - latency.firstbucket;
+		if (j >= (int)buckets.size()) {
+			buckets.resize(j + 1, 0);
+		}
+		++buckets[j];
+	}
+	stackFrame.numpending = 0;
+}
+
+#ifndef TRACE_AGGREGATE
+static void AddBlockToIndex(TraceWriter_t& writer, int blocknum, uint64_t start, uint64_t end) {
+	const auto start_index = (int)(start / INDEX_TIMEBASE_IN_TICKS);
+	const auto end_index = (int)(end / INDEX_TIMEBASE_IN_TICKS);
+
+	for (auto i = start_index; i <= end_index; ++i) {
+		indexentry_t entry;
+		entry.index = i;
+		entry.blocknum = blocknum;
+		writer.index.push_back(entry);
+	}
+}
+#endif
+
+static inline void PackVarint(std::vector<uint8_t>& packed, uint64_t value) {
+	while (value >= 0x80) {
+		packed.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	packed.push_back((uint8_t)value);
+}
+
+static inline uint64_t ZigZag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static void WriteBlockSegment(TraceWriter_t& writer) {
+	if (writer.blocks.empty()) {
+		return;
+	}
+
+	const auto numblocks = (int)writer.blocks.size();
+	const auto firstblock = writer.numblocks - numblocks;
+
+	auto& packed = writer.packed;
+	packed.clear();
+
+	uint64_t start = 0;
+	int numparents = 0;
+	for (int i = 0; i < numblocks; ++i) {
+		const auto& block = writer.blocks[i];
+		PackVarint(packed, ZigZag((int64_t)(block.start - start)));
+		PackVarint(packed, block.end ? (block.end - block.start + 1) : 0);
+		PackVarint(packed, block.childTime);
+		PackVarint(packed, (uint64_t)TraceCrcFind(writer.stackFrameTable, block.stackframe));
+		PackVarint(packed, block.tag ? (uint64_t)TraceCrcFind(writer.tagTable, block.tag) + 1 : 0);
+		PackVarint(packed, (block.parent >= 0) ? (uint64_t)(firstblock + i - block.parent) : 0);
+		PackVarint(packed, ZigZag(block.numparents - numparents));
+		start = block.start;
+		numparents = block.numparents;
+	}
+
+	const auto bytes = packed.size();
+	packed.resize((bytes + 7) & ~(size_t)7, 0);
+
+	segment_t segment;
+	segment.magic = TRACE_MAGIC_PACKED_BLOCKS;
+	segment.size = (uint32_t)(sizeof(packedsegment_t) + packed.size());
+
+	packedsegment_t blocks;
+	blocks.firstblock = firstblock;
+	blocks.numblocks = numblocks;
+	blocks.bytes = (uint32_t)bytes;
+	blocks.padd = 0;
+
+	TraceOutputWrite(writer.out, &segment, sizeof(segment));
+	TraceOutputWrite(writer.out, &blocks, sizeof(blocks));
+	TraceOutputWrite(writer.out, &packed[0], packed.size());
+	writer.blocks.clear();
+}
+
+static void AddTag(TraceWriter_t& writer, uint32_t tag) {
+	if (tag && (TraceCrcFind(writer.tagTable, tag) < 0)) {
+		TraceCrcInsert(writer.tagTable, tag, (int)writer.tagIDs.size());
+		writer.tagIDs.push_back(tag);
+	}
+}
+
+#ifndef TRACE_AGGREGATE
+// keeps the TRACE_SLOWEST_CALLS slowest calls, the stack frame has the
+// time a call needs to take to be one of them so most never get here.
+static void AddSlowCall(TraceLatency_t& latency, StackFrame_t& stackFrame, uint64_t wallTime, int blocknum) {
+	const auto slowest = latency.slowest;
+	const auto slower = [](const TraceSlowCall_t& a, const TraceSlowCall_t& b) { return a.time > b.time; };
+	if (latency.numslowest == TRACE_SLOWEST_CALLS) {
+		std::pop_heap(slowest, slowest + latency.numslowest--, slower);
+	}
+	auto& call = slowest[latency.numslowest++];
+	call.time = wallTime;
+	call.blocknum = blocknum;
+	call.padd = 0;
+	std::push_heap(slowest, slowest + latency.numslowest, slower);
+	if (latency.numslowest == TRACE_SLOWEST_CALLS) {
+		stackFrame.slowestTime = slowest[0].time;
+	}
+}
+
+static void AddCallTime(TraceWriter_t& writer, StackFrame_t& stackFrame, uint64_t wallTime, int blocknum, uint16_t skipped) {
+	const auto idx = (int)(&stackFrame - writer.stackFrames.data());
+	if (wallTime > stackFrame.slowestTime) {
+		AddSlowCall(writer.latencies[idx], stackFrame, wallTime, blocknum);
+	}
+	stackFrame.pending[stackFrame.numpending++] = wallTime;
+	if (stackFrame.numpending == TRACE_LATENCY_PENDING) {
+		AddPendingLatency(writer, idx);
+	}
+	stackFrame.wallTime += wallTime;
+	if (skipped) {
+		++stackFrame.sampledCalls;
+		stackFrame.sampledTime += wallTime;
+		stackFrame.skippedCalls += skipped;
+	}
+	if ((stackFrame.bestcall < 0) || (wallTime < stackFrame.bestCallTime)) {
+		stackFrame.bestCallTime = wallTime;
+		stackFrame.bestcall = blocknum;
+	}
+	if ((stackFrame.worstcall < 0) || (wallTime > stackFrame.worstCallTime)) {
+		stackFrame.worstCallTime = wallTime;
+		stackFrame.worstcall = blocknum;
+	}
+}
+#endif
+
+// the site's stack frame, added with no calls the first time it's seen.
+static StackFrame_t& ChangeStackFrame(TraceWriter_t& writer, const TraceSite_t& site) {
+	const auto stackframe = site.location.crc;
+	const auto idx = TraceCrcFind(writer.stackFrameTable, stackframe);
+	if (idx >= 0) {
+		return ChangeStackFrame(writer, idx);
+	}
+
+	TraceCrcInsert(writer.stackFrameTable, stackframe, (int)writer.stackFrames.size());
+	writer.stackFrameIDs.push_back(stackframe);
+	writer.isChanged.push_back(false);
+
+	const auto category = TraceGetCategoryTag(site.category);
+	writer.stackFrameCategories.push_back(category);
+	AddTag(writer, category);
+#ifndef TRACE_FLIGHT_RECORDER
+	writer.stackFrameSites.push_back((uint16_t)(&site - s_sites));
+	writer.stackFrameCalls.push_back(0);
+	writer.stackFrameRates.push_back(0);
+#endif
+
+	StackFrame_t frame;
+	memset(&frame, 0, sizeof(frame));
+	strcpy_s(frame.label, site.label.str);
+	strcpy_s(frame.location, site.location.str);
+	frame.bestcall = -1;
+	frame.worstcall = -1;
+	writer.stackFrames.push_back(frame);
+	writer.latencies.emplace_back();
+	return ChangeStackFrame(writer, (int)writer.stackFrames.size() - 1);
+}
+
+#ifndef TRACE_AGGREGATE
+static TraceContext_t& ChangeContext(TraceWriter_t& writer, int idx) {
+	auto& context = writer.contexts[idx];
+	if (!context.changed) {
+		context.changed = true;
+		writer.changedContexts.push_back(idx);
+	}
+	return context;
+}
+
+static inline uint32_t TraceContextKey(const TraceWriter_t& writer, int parent, int stackframe) {
+	return writer.stackFrameIDs[stackframe] ^ ((uint32_t)(parent + 1) * 0x85ebca6bu);
+}
+
+// the context of a block, adding it to the tree the first time its path is
+// seen.
+static TraceContext_t& ChangeContext(TraceWriter_t& writer, int blocknum, int parentblock, int stackframe) {
+	auto& path = writer.contextPath;
+	while (!path.empty() && (path.back().blocknum != parentblock)) {
+		path.pop_back();
+	}
+	const auto parent = path.empty() ? -1 : path.back().context;
+	const auto key = TraceContextKey(writer, parent, stackframe);
+
+	auto& table = writer.contextTable;
+	int idx = -1;
+	if (!table.slots.empty()) {
+		const auto mask = table.slots.size() - 1;
+		for (auto i = TraceCrcSlot(key, mask); table.slots[i].index >= 0; i = (i + 1) & mask) {
+			const auto& slot = table.slots[i];
+			if ((slot.crc == key) && (writer.contexts[slot.index].parent == parent) && (writer.contexts[slot.index].stackframe == stackframe)) {
+				idx = slot.index;
+				break;
+			}
+		}
+	}
+
+	if (idx < 0) {
+		idx = (int)writer.contexts.size();
+		TraceCrcInsert(table, key, idx);
+
+		TraceContext_t context;
+		memset(&context, 0, sizeof(context));
+		context.parent = parent;
+		context.stackframe = stackframe;
+		writer.contexts.push_back(context);
+	}
+
+	TraceWriter_t::ContextPath_t top;
+	top.blocknum = blocknum;
+	top.context = idx;
+	path.push_back(top);
+	return ChangeContext(writer, idx);
+}
+#endif
+
+#ifndef TRACE_AGGREGATE
+// Stack frames get their child time from their own blocks, which includes
+// children that were elided or dropped.
+static void WriteBlock(TraceWriter_t& writer, int blocknum, block_t& file_block, const TraceSite_t& site, uint16_t skipped) {
+	TRACE_ASSERT(blocknum == writer.numblocks);
+	TRACE_ASSERT(file_block.stackframe == site.location.crc);
+
+	if (file_block.end == 0) {
+		file_block.childTime = 0;
+		// this block is currently unterminated and will not
+		// have correct timing counts in child stack frames.
+		writer.open.push_back(blocknum);
+	}
+
+	writer.maxparents = std::max(writer.maxparents, file_block.numparents);
+	writer.lastTick = file_block.start;
+
+	writer.blocks.push_back(file_block);
+	++writer.numblocks;
+	if (writer.blocks.size() >= TRACE_SEGMENT_BLOCKS) {
+		WriteBlockSegment(writer);
+	}
+
+	{
+		auto& stackFrame = ChangeStackFrame(writer, site);
+		++stackFrame.callCount;
+		if (file_block.end) {
+			AddCallTime(writer, stackFrame, file_block.end - file_block.start, blocknum, skipped);
+			stackFrame.childTime += file_block.childTime;
+		}
+
+		const auto idx = (int)(&stackFrame - writer.stackFrames.data());
+		auto& context = ChangeContext(writer, blocknum, file_block.parent, idx);
+		++context.callCount;
+		if (file_block.end) {
+			context.wallTime += file_block.end - file_block.start;
+			context.childTime += file_block.childTime;
+		} else {
+			writer.openContexts.push_back((int)(&context - writer.contexts.data()));
+		}
+	}
+
+	if (file_block.end) {
+		AddBlockToIndex(writer, blocknum, file_block.start, file_block.end);
+	}
+
+	AddTag(writer, file_block.tag);
+}
+#endif
+
+#ifdef TRACE_WRITER_POOL
+// fixes up a block that was written unterminated, in place if it is still
+// buffered or with a patch in the next checkpoint.
+static void RewriteBlock(TraceWriter_t& writer, int blocknum, const block_t& file_block, uint16_t skipped) {
+	// open blocks close innermost first so this erases at (or near) the end.
+	auto& open = writer.open;
+	const auto pos = std::lower_bound(open.begin(), open.end(), blocknum);
+	TRACE_ASSERT((pos != open.end()) && (*pos == blocknum));
+	const auto openContext = writer.openContexts.begin() + (pos - open.begin());
+	const auto contextIdx = *openContext;
+	writer.openContexts.erase(openContext);
+	open.erase(pos);
+
+	if (file_block.end) {
+		AddBlockToIndex(writer, blocknum, file_block.start, file_block.end);
+
+		const auto idx = TraceCrcFind(writer.stackFrameTable, file_block.stackframe);
+		TRACE_ASSERT(idx >= 0);
+		auto& stackFrame = ChangeStackFrame(writer, idx);
+		AddCallTime(writer, stackFrame, file_block.end - file_block.start, blocknum, skipped);
+		stackFrame.childTime += file_block.childTime;
+
+		auto& context = ChangeContext(writer, contextIdx);
+		context.wallTime += file_block.end - file_block.start;
+		context.childTime += file_block.childTime;
+	}
+
+	const auto firstblock = writer.numblocks - (int)writer.blocks.size();
+	if (blocknum >= firstblock) {
+		writer.blocks[blocknum - firstblock] = file_block;
+	} else {
+		patch_t patch;
+		patch.blocknum = blocknum;
+		patch.padd = 0;
+		patch.block = file_block;
+		writer.patches.push_back(patch);
+	}
+}
+#endif
+
+static void WriteCounterSegment(TraceWriter_t& writer) {
+	auto& samples = writer.samples;
+	if (samples.empty()) {
+		return;
+	}
+
+	auto& packed = writer.packed;
+	packed.clear();
+
+	auto& values = writer.counterValues;
+	values.assign(writer.counterSites.size(), 0);
+	uint64_t tick = 0;
+	auto tick_start = samples.front().tick;
+	auto tick_end = samples.front().tick;
+	for (const auto& sample : samples) {
+		tick_start = std::min(tick_start, sample.tick);
+		tick_end = std::max(tick_end, sample.tick);
+		PackVarint(packed, (uint64_t)sample.counter);
+		PackVarint(packed, ZigZag((int64_t)(sample.tick - tick)));
+		if (writer.counterTypes[sample.counter] == TRACE_COUNTER_DOUBLE) {
+			PackVarint(packed, sample.value ^ values[sample.counter]);
+		} else {
+			PackVarint(packed, ZigZag((int64_t)(sample.value - values[sample.counter])));
+		}
+		tick = sample.tick;
+		values[sample.counter] = sample.value;
+	}
+
+	const auto bytes = packed.size();
+	packed.resize((bytes + 7) & ~(size_t)7, 0);
+
+	const auto numcounters = (int)writer.counterSites.size() - writer.numcountersWritten;
+
+	segment_t segment;
+	segment.magic = TRACE_MAGIC_COUNTERS;
+	segment.size = (uint32_t)(sizeof(countersegment_t) + (sizeof(counterdef_t) * numcounters) + packed.size());
+
+	countersegment_t counters;
+	counters.numcounters = numcounters;
+	counters.numsamples = (int)samples.size();
+	counters.bytes = (uint32_t)bytes;
+	counters.padd = 0;
+	counters.tick_start = tick_start;
+	counters.tick_end = tick_end;
+
+	TraceOutputWrite(writer.out, &segment, sizeof(segment));
+	TraceOutputWrite(writer.out, &counters, sizeof(counters));
+
+	for (auto i = writer.numcountersWritten; i < (int)writer.counterSites.size(); ++i) {
+		const auto& site = *writer.counterSites[i];
+		counterdef_t def;
+		memset(&def, 0, sizeof(def));
+		def.id = site.location.crc;
+		def.category = TraceGetCategoryTag(site.category);
+		def.type = writer.counterTypes[i];
+		strcpy_s(def.label, site.label.str);
+		strcpy_s(def.location, site.location.str);
+		TraceOutputWrite(writer.out, &def, sizeof(def));
+	}
+
+	TraceOutputWrite(writer.out, &packed[0], packed.size());
+	writer.numcountersWritten = (int)writer.counterSites.size();
+	samples.clear();
+}
+
+#ifndef TRACE_AGGREGATE
+// a counter keeps the type of its first sample, later ones are converted.
+static void AddCounterSample(TraceWriter_t& writer, const TraceSite_t& site, uint64_t tick, uint64_t value, uint16_t type) {
+	auto idx = TraceCrcFind(writer.counterTable, site.location.crc);
+	if (idx < 0) {
+		idx = (int)writer.counterSites.size();
+		TraceCrcInsert(writer.counterTable, site.location.crc, idx);
+		writer.counterSites.push_back(&site);
+		writer.counterTypes.push_back(type);
+		AddTag(writer, TraceGetCategoryTag(site.category));
+	} else if (type != writer.counterTypes[idx]) {
+		if (type == TRACE_COUNTER_DOUBLE) {
+			double d;
+			memcpy(&d, &value, sizeof(d));
+			value = (uint64_t)(int64_t)d;
+		} else {
+			const auto d = (double)(int64_t)value;
+			memcpy(&value, &d, sizeof(value));
+		}
+	}
+
+	TraceCounterSample_t sample;
+	sample.tick = tick;
+	sample.value = value;
+	sample.counter = idx;
+	sample.padd = 0;
+	writer.samples.push_back(sample);
+	++writer.numsamples;
+	if (writer.samples.size() >= TRACE_SEGMENT_BLOCKS) {
+		WriteCounterSegment(writer);
+	}
+}
+#endif
+
+static void WriteContextSegment(TraceWriter_t& writer) {
+	auto& changed = writer.changedContexts;
+	if (changed.empty()) {
+		return;
+	}
+
+	auto& packed = writer.packed;
+	packed.clear();
+
+	const auto firstnode = writer.numcontextsWritten;
+	const auto numnodes = (int)writer.contexts.size() - firstnode;
+	for (auto i = firstnode; i < (int)writer.contexts.size(); ++i) {
+		const auto& context = writer.contexts[i];
+		PackVarint(packed, (uint64_t)(context.parent + 1));
+		PackVarint(packed, (uint64_t)context.stackframe);
+	}
+
+	std::sort(changed.begin(), changed.end());
+	int node = 0;
+	for (const auto i : changed) {
+		auto& context = writer.contexts[i];
+		PackVarint(packed, (uint64_t)(i - node));
+		PackVarint(packed, context.callCount);
+		PackVarint(packed, context.wallTime);
+		PackVarint(packed, context.childTime);
+		context.changed = false;
+		node = i;
+	}
+
+	const auto bytes = packed.size();
+	packed.resize((bytes + 7) & ~(size_t)7, 0);
+
+	segment_t segment;
+	segment.magic = TRACE_MAGIC_CONTEXTS;
+	segment.size = (uint32_t)(sizeof(contextsegment_t) + packed.size());
+
+	contextsegment_t contexts;
+	contexts.firstnode = firstnode;
+	contexts.numnodes = numnodes;
+	contexts.numchanged = (int)changed.size();
+	contexts.bytes = (uint32_t)bytes;
+
+	TraceOutputWrite(writer.out, &segment, sizeof(segment));
+	TraceOutputWrite(writer.out, &contexts, sizeof(contexts));
+	TraceOutputWrite(writer.out, &packed[0], packed.size());
+	writer.numcontextsWritten = (int)writer.contexts.size();
+	changed.clear();
+}
+
+static void WriteCheckpoint(TraceWriter_t& writer, uint64_t tick_end, bool final) {
+	WriteBlockSegment(writer);
+	WriteCounterSegment(writer);
+	WriteContextSegment(writer);
+
+	// readers need two sync points to convert ticks, and one after the
+	// last block to not have to extrapolate.
+	auto& syncs = writer.syncs;
+	{
+		LOCK L(s_syncLock);
+		if (final || (s_syncPoints.size() < 2) || ((GetNanoseconds() - s_nanoStart - s_syncPoints.back().nanos) >= (TRACE_SYNC_INTERVAL * 1000000ull))) {
+			TraceAddSyncPoint();
+		}
+		syncs.assign(s_syncPoints.begin() + writer.numsyncsWritten, s_syncPoints.end());
+	}
+
+	auto& out = writer.out;
+
+	checkpoint_t checkpoint;
+	checkpoint.numblocks = writer.numblocks;
+	checkpoint.maxparents = writer.maxparents;
+	checkpoint.numstacks = (int)writer.stackFrames.size() - writer.numstacksWritten;
+	checkpoint.numstackstats = (int)writer.changed.size();
+	checkpoint.numtags = (int)writer.tagIDs.size() - writer.numtagsWritten;
+	checkpoint.numpatches = (int)writer.patches.size();
+	checkpoint.numopen = (int)writer.open.size();
+	checkpoint.numindices = (int)writer.index.size();
+	checkpoint.tick_start = writer.tick_start;
+	checkpoint.tick_end = tick_end;
+	checkpoint.final = final ? 1 : 0;
+	checkpoint.numsyncs = (int)syncs.size();
+
+	auto& packed = writer.packed;
+	packed.clear();
+	{
+		int index = 0;
+		int blocknum = 0;
+		for (const auto& entry : writer.index) {
+			PackVarint(packed, ZigZag(entry.index - index));
+			PackVarint(packed, ZigZag(entry.blocknum - blocknum));
+			index = entry.index;
+			blocknum = entry.blocknum;
+		}
+	}
+	checkpoint.indexbytes = (uint32_t)packed.size();
+	packed.resize((packed.size() + 7) & ~(size_t)7, 0);
+
+	auto& packedLatency = writer.packedLatency;
+	packedLatency.clear();
+	for (const auto i : writer.changed) {
+		AddPendingLatency(writer, i);
+		const auto& latency = writer.latencies[i];
+		TraceSlowCall_t slowest[TRACE_SLOWEST_CALLS];
+		std::copy(latency.slowest, latency.slowest + latency.numslowest, slowest);
+		std::sort(slowest, slowest + latency.numslowest, [](const TraceSlowCall_t& a, const TraceSlowCall_t& b) { return a.time > b.time; });
+		PackVarint(packedLatency, latency.numslowest);
+		for (int j = 0; j < latency.numslowest; ++j) {
+			PackVarint(packedLatency, slowest[j].blocknum);
+			PackVarint(packedLatency, slowest[j].time);
+		}
+
+		const auto& buckets = latency.buckets;
+		PackVarint(packedLatency, buckets.size() - std::count(buckets.begin(), buckets.end(), 0));
+		int bucket = 0;
+		for (int j = 0; j < (int)buckets.size(); ++j) {
+			if (buckets[j]) {
+				PackVarint(packedLatency, latency.firstbucket + j - bucket);
+				PackVarint(packedLatency, buckets[j]);
+				bucket = latency.firstbucket + j;
+			}
+		}
+	}
+	checkpoint.latencybytes = (uint32_t)packedLatency.size();
+	packedLatency.resize((packedLatency.size() + 7) & ~(size_t)7, 0);
+
+	const auto numopen = (checkpoint.numopen + 1) & ~1;
+
+	segment_t segment;
+	segment.magic = TRACE_MAGIC_CHECKPOINT;
+	segment.size = (uint32_t)(sizeof(checkpoint) +
+		(sizeof(stackdef_t) * checkpoint.numstacks) +
+		(sizeof(stackstats_t) * checkpoint.numstackstats) +
+		(sizeof(tagdef_t) * checkpoint.numtags) +
+		(sizeof(patch_t) * checkpoint.numpatches) +
+		(sizeof(int) * numopen) +
+		packed.size() +
+		(sizeof(syncpoint_t) * checkpoint.numsyncs) +
+		packedLatency.size() +
+		sizeof(checkpointend_t));
+
+	TraceOutputWrite(out, &segment, sizeof(segment));
+	TraceOutputWrite(out, &checkpoint, sizeof(checkpoint));
+
+	for (auto i = writer.numstacksWritten; i < (int)writer.stackFrames.size(); ++i) {
+		stackdef_t def;
+		def.id = writer.stackFrameIDs[i];
+		def.category = writer.stackFrameCategories[i];
+		memcpy(def.label, writer.stackFrames[i].label, sizeof(def.label));
+		memcpy(def.location, writer.stackFrames[i].location, sizeof(def.location));
+		TraceOutputWrite(out, &def, sizeof(def));
+	}
+
+	for (const auto i : writer.changed) {
+		const auto& frame = writer.stackFrames[i];
+		stackstats_t stats;
+		stats.id = writer.stackFrameIDs[i];
+		stats.bestcall = frame.bestcall;
+		stats.worstcall = frame.worstcall;
+		stats.padd = 0;
+		stats.wallTime = frame.wallTime;
+		stats.childTime = frame.childTime;
+		stats.callCount = frame.callCount;
+		stats.bestCallTime = frame.bestCallTime;
+		stats.worstCallTime = frame.worstCallTime;
+		stats.elidedCalls = frame.elidedCalls;
+		stats.sampledCalls = frame.sampledCalls;
+		stats.sampledTime = frame.sampledTime;
+		stats.skippedCalls = frame.skippedCalls;
+		TraceOutputWrite(out, &stats, sizeof(stats));
+		writer.isChanged[i] = false;
+	}
+
+	for (auto i = writer.numtagsWritten; i < (int)writer.tagIDs.size(); ++i) {
+		tagdef_t def;
+		memset(&def, 0, sizeof(def));
+		def.id = writer.tagIDs[i];
+		strcpy_s(def.string, TraceGetTag(def.id));
+		TraceOutputWrite(out, &def, sizeof(def));
+	}
+
+	if (!writer.patches.empty()) {
+		TraceOutputWrite(out, &writer.patches[0], sizeof(patch_t) * writer.patches.size());
+	}
+
+	if (!writer.open.empty()) {
+		TraceOutputWrite(out, &writer.open[0], sizeof(int) * writer.open.size());
+	}
+	if (numopen != checkpoint.numopen) {
+		const int padd = 0;
+		TraceOutputWrite(out, &padd, sizeof(padd));
+	}
+
+	if (!packed.empty()) {
+		TraceOutputWrite(out, &packed[0], packed.size());
+	}
+
+	if (!syncs.empty()) {
+		TraceOutputWrite(out, &syncs[0], sizeof(syncpoint_t) * syncs.size());
+	}
+
+	if (!packedLatency.empty()) {
+		TraceOutputWrite(out, &packedLatency[0], packedLatency.size());
+	}
+
+	checkpointend_t end;
+	end.magic = TRACE_MAGIC_CHECKPOINT_END;
+	end.numblocks = writer.numblocks;
+	TraceOutputWrite(out, &end, sizeof(end));
+
+	TraceOutputSync(out);
+
+	writer.numstacksWritten = (int)writer.stackFrames.size();
+	writer.numtagsWritten = (int)writer.tagIDs.size();
+	writer.numsyncsWritten += (int)syncs.size();
+	writer.changed.clear();
+	writer.patches.clear();
+	writer.index.clear();
+	writer.checkpointBlocks = writer.numblocks;
+	writer.checkpointMicros = GetMicroseconds();
+}
+
+#ifdef TRACE_WRITER_POOL
+// every block changes a stack frame so nothing changed without one.
+static bool CheckpointDue(const TraceWriter_t& writer) {
+	return !writer.changed.empty() &&
+		(((writer.numblocks - writer.checkpointBlocks) >= TRACE_CHECKPOINT_BLOCKS) ||
+		((GetMicroseconds() - writer.checkpointMicros) >= (TRACE_CHECKPOINT_INTERVAL * 1000)));
+}
+#endif
+
+#ifndef TRACE_FLIGHT_RECORDER
+
+// TraceSetSampling() state. Every writer measures the call rate of each
+// site in its thread over the ticks its blocks span rather than wall time,
+// writers fall behind exactly when sites are hot. s_siteRates is what they
+// add up to and whichever writer gets there first picks new periods.
+static std::mutex s_sampleLock;
+static std::atomic<uint32_t> s_sampleRate; // 0 when sampling is off
+static uint32_t s_sampleBudget; // under s_sampleLock
+static uint64_t s_sampleMicros; // when the periods were last picked
+static std::atomic<uint64_t> s_siteRates[TRACE_MAX_SITES]; // calls a second
+
+void TraceSetSampling(uint32_t callsPerSecond, uint32_t budgetPerSecond) {
+	LOCK L(s_sampleLock);
+	s_sampleRate.store(callsPerSecond, std::memory_order_relaxed);
+	s_sampleBudget = std::max(budgetPerSecond, 1u);
+	s_sampleMicros = GetMicroseconds();
+	if (!callsPerSecond) {
+		const auto numSites = TraceGetNumSites();
+		for (int i = 1; i < numSites; ++i) {
+			TraceSetSamplePeriod(i, 1);
+		}
+	}
+}
+
+// called before each checkpoint, the last one takes the thread's calls back
+// out. Sampled calls count the ones they stood in for.
+static void TraceAddSiteCalls(TraceWriter_t& writer, bool final) {
+	const auto sampleRate = s_sampleRate.load(std::memory_order_relaxed);
+	if (!final && (!sampleRate || (writer.lastTick == writer.sampleTick))) {
+		return;
+	}
+
+	const auto ticks = writer.lastTick - writer.sampleTick;
+	const auto ticksPerSecond = TraceTicksPerMilli() * 1000.0;
+	for (size_t i = 0; i < writer.stackFrames.size(); ++i) {
+		const auto& frame = writer.stackFrames[i];
+		const auto calls = frame.callCount + frame.skippedCalls;
+		const auto rate = (final || !ticks) ? 0 : (uint64_t)((calls - writer.stackFrameCalls[i]) * ticksPerSecond / ticks);
+		s_siteRates[writer.stackFrameSites[i]].fetch_add(rate - writer.stackFrameRates[i], std::memory_order_relaxed);
+		writer.stackFrameCalls[i] = calls;
+		writer.stackFrameRates[i] = rate;
+	}
+	writer.sampleTick = writer.lastTick;
+
+	std::unique_lock<std::mutex> L(s_sampleLock, std::try_to_lock);
+	if (!sampleRate || !L.owns_lock() || ((GetMicroseconds() - s_sampleMicros) < (TRACE_SAMPLE_INTERVAL * 1000))) {
+		return;
+	}
+	s_sampleMicros = GetMicroseconds();
+
+	const auto numSites = TraceGetNumSites();
+	for (int i = 1; i < numSites; ++i) {
+		const auto rate = s_siteRates[i].load(std::memory_order_relaxed);
+		const auto period = (rate > sampleRate) ? (uint32_t)std::min<uint64_t>((rate + s_sampleBudget - 1) / s_sampleBudget, TRACE_MAX_SAMPLE_PERIOD) : 1;
+		TraceSetSamplePeriod(i, period);
+	}
+}
+#endif
+
+#ifndef TRACE_AGGREGATE
+static void FinishTraceFile(TraceWriter_t& writer, const char* path, uint64_t tick_start, uint64_t tick_end) {
+	TRACE_ASSERT(writer.open.empty());
+
+	writer.tick_start = tick_start;
+	WriteCheckpoint(writer, tick_end, true);
+	TraceOutputClose(writer.out);
+
+	trace_DebugWriteLine("Trace: wrote %i stack frames to [%s].", writer.numblocks, path);
+}
+#endif
+
+// applies the TraceSetWriterThreads() affinity and priority to the calling thread.
+static void TraceConfigureWriterThread() {
+#ifdef _WIN32
+	if (s_writerAffinity) {
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)s_writerAffinity);
+	}
+	if (s_writerPriority) {
+		SetThreadPriority(GetCurrentThread(), s_writerPriority);
+	}
+#elif defined(__linux__)
+	pthread_setname_np(pthread_self(), "TraceWriter");
+	if (s_writerAffinity) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64; ++i) {
+			if (s_writerAffinity & (1ull << i)) {
+				CPU_SET(i, &set);
+			}
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	if (s_writerPriority) {
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), s_writerPriority);
+	}
+#endif
+}
+
+void TraceSetOutput(int output) {
+	s_output = output;
+}
+
+void TraceSetWriterThreads(int count, uint64_t affinityMask, int priority) {
+	LOCK L(M);
+	s_numWriterThreads = std::max(count, 1);
+	s_writerAffinity = affinityMask;
+	s_writerPriority = priority;
+}
+
+#ifdef TRACE_WRITER_POOL
+// a block that was written unterminated, rewritten once it has closed.
+struct TraceUnterminatedBlock_t {
+	block_t file_block;
+	int blocknum;
+#ifndef TRACE_COMPACT_EVENTS
+	int record; // in the thread's records, counter samples before it make blocknum lag behind
+#endif
+	uint16_t skipped;
+};
+
+#ifdef TRACE_COMPACT_EVENTS
+struct TraceOpenBlock_t {
+	const TraceSite_t* site;
+	uint16_t skipped;
+	uint32_t tag;
+	uint64_t start;
+	uint64_t childTime;
+	int blocknum;
+	int parent;
+	int numparents;
+	int pending; // index into pending, -1 once written unterminated
+};
+
+struct TracePendingBlock_t {
+	block_t file_block;
+	const TraceSite_t* site;
+	uint16_t skipped;
+};
+#else
+struct TraceParent_t {
+	int record;
+	int blocknum;
+	int numparents;
+};
+#endif
+
+// What the writer pool knows about a traced thread. Only the pool thread
+// that has it busy touches anything but busy and pass.
+struct TraceThreadWriter_t {
+	TraceThread_t* thread; // the chunk being read
+	TraceRing_t* ring;
+	TraceWriter_t writer;
+	int cursor; // next record to read
+	bool busy;
+	uint32_t pass; // last pool pass that serviced it
+#ifdef TRACE_COMPACT_EVENTS
+	int numblocks;
+	std::vector<TraceOpenBlock_t> stack;
+	std::vector<TracePendingBlock_t> pending;
+#else
+	// ancestors of the next block with their depth, so numparents never
+	// walks parent links (or chunks that have been released).
+	std::vector<TraceParent_t> parents;
+	std::vector<TraceUnterminatedBlock_t> open; // written unterminated, still open
+#endif
+	std::vector<TraceUnterminatedBlock_t> closed; // written unterminated and closed since
+#ifdef TRACE_VIRTUAL_STORAGE
+	size_t decommitted; // pages below this have been given back, except keptPages
+	std::vector<size_t> keptPages; // pages with blocks that were still open
+#endif
+};
+
+static std::vector<TraceThreadWriter_t*> s_threadWriters;
+static std::vector<std::thread> s_writerThreads;
+static std::condition_variable s_writerCV;
+static uint32_t s_writerPass = 0;
+static bool s_writerQuit = false;
+
+static TraceThreadWriter_t* TraceNewThreadWriter(TraceThread_t* thread) {
+	auto w = new TraceThreadWriter_t();
+	w->thread = thread;
+	w->ring = thread->ring;
+	w->cursor = 0;
+	w->busy = false;
+	w->pass = 0;
+#ifdef TRACE_COMPACT_EVENTS
+	w->numblocks = 0;
+#endif
+#ifdef TRACE_VIRTUAL_STORAGE
+	// the page(s) with the thread header stay.
+	w->decommitted = (TRACE_RECORD_OFS(0) + TRACE_VIRTUAL_PAGE - 1) & ~(size_t)(TRACE_VIRTUAL_PAGE - 1);
+#endif
+
+	const auto opened = BeginTraceFile(w->writer, thread->path, thread->tsc_start - s_tscStart);
+	TRACE_VERIFY(opened);
+	return w;
+}
+
+#ifdef TRACE_VIRTUAL_STORAGE
+// a compact build's thread never looks at an event again once it is
+// written, otherwise it still pops (and the writer fixes up) open blocks.
+static bool TraceVirtualPageOpen(const TraceThreadWriter_t& w, size_t page) {
+#ifdef TRACE_COMPACT_EVENTS
+	(void)w;
+	(void)page;
+	return false;
+#else
+	const auto first = (page > TRACE_RECORD_OFS(0)) ? (int)((page - TRACE_RECORD_OFS(0)) / TRACE_RECORD_BYTES) : 0;
+	const auto last = (int)((page + TRACE_VIRTUAL_PAGE - 1 - TRACE_RECORD_OFS(0)) / TRACE_RECORD_BYTES);
+	const auto pos = std::lower_bound(w.open.begin(), w.open.end(), first, [](const TraceUnterminatedBlock_t& u, int num) { return u.record < num; });
+	return (pos != w.open.end()) && (pos->record <= last);
+#endif
+}
+
+// gives back the pages of the records that have been written so a long
+// capture only keeps what the writer hasn't got to yet in memory.
+static void TraceDecommitWritten(TraceThreadWriter_t& w) {
+	const auto thread = w.thread;
+	const auto to = TRACE_RECORD_OFS(w.cursor) & ~(size_t)(TRACE_VIRTUAL_PAGE - 1);
+
+	auto& kept = w.keptPages;
+	size_t numkept = 0;
+	for (const auto page : kept) {
+		if (TraceVirtualPageOpen(w, page)) {
+			kept[numkept++] = page;
+		} else {
+			TraceVirtualDecommit(thread, page, page + TRACE_VIRTUAL_PAGE);
+		}
+	}
+	kept.resize(numkept);
+
+	auto from = w.decommitted;
+	for (auto page = w.decommitted; page < to; page += TRACE_VIRTUAL_PAGE) {
+		if (TraceVirtualPageOpen(w, page)) {
+			if (from < page) {
+				TraceVirtualDecommit(thread, from, page);
+			}
+			kept.push_back(page);
+			from = page + TRACE_VIRTUAL_PAGE;
+		}
+	}
+	if (from < to) {
+		TraceVirtualDecommit(thread, from, to);
+	}
+	w.decommitted = std::max(w.decommitted, to);
+}
+#endif
+
+static bool TraceThreadWriterReady(const TraceThreadWriter_t& w) {
+	const auto numrecords = w.thread->writeblocks.load(std::memory_order_acquire);
+	return (numrecords == -1) || (w.cursor < numrecords) || w.thread->ended.load(std::memory_order_acquire) || CheckpointDue(w.writer);
+}
+
+#ifdef TRACE_COMPACT_EVENTS
+// writes what the thread has published so far, false once its file is finished.
+static bool TraceThreadWriterPump(TraceThreadWriter_t& w) {
+	auto& thread = w.thread;
+	auto& curevent = w.cursor;
+	auto& numblocks = w.numblocks;
+	auto& writer = w.writer;
+	auto& stack = w.stack;
+	auto& pending = w.pending;
+	auto& closed = w.closed;
+	auto ring = w.ring;
+
+	for (;;) {
+		const auto numevents = thread->writeblocks.load(std::memory_order_acquire);
+		if (numevents == -1) {
+			TRACE_ASSERT(thread->next);
+			thread = thread->next;
+			continue;
+		} else if (curevent < numevents) {
+			for (; curevent < numevents; ++curevent) {
+				const auto* event = TraceGetEventNum(thread, curevent);
+				if (event->data == TRACE_EVENT_END) {
+					TRACE_ASSERT(!stack.empty());
+					const auto& open = stack.back();
+					
+					block_t file_block;
+					file_block.stackframe = open.site->location.crc;
+					file_block.tag = open.tag;
+					file_block.start = GetRelativeTicks(open.start);
+					file_block.end = GetRelativeTicks(event->tsc);
+					file_block.childTime = open.childTime;
+					file_block.parent = open.parent;
+					file_block.numparents = open.numparents;
+
+					if (stack.size() > 1) {
+						stack[stack.size() - 2].childTime += event->tsc - open.start;
+					}
+
+					if (open.pending >= 0) {
+						pending[open.pending].file_block = file_block;
+					} else {
+						TraceUnterminatedBlock_t block;
+						block.file_block = file_block;
+						block.blocknum = open.blocknum;
+						block.skipped = open.skipped;
+						closed.push_back(block);
+					}
+
+					stack.pop_back();
+				} else if (event->data == TRACE_EVENT_TAG) {
+					TRACE_ASSERT(!stack.empty());
+					auto& open = stack.back();
+					open.tag = (uint32_t)event->tsc;
+					if (open.pending >= 0) {
+						pending[open.pending].file_block.tag = open.tag;
+					}
+				} else if ((event->data & 3) == TRACE_EVENT_COUNTER) {
+					// the value event was published along with it.
+					const auto* value = TraceGetEventNum(thread, ++curevent);
+					AddCounterSample(writer, s_sites[TRACE_EVENT_GET_SITE(event->data)], GetRelativeTicks(event->tsc), value->tsc, TRACE_EVENT_GET_SKIPPED(event->data));
+				} else {
+					TraceOpenBlock_t open;
+					open.site = &s_sites[TRACE_EVENT_GET_SITE(event->data)];
+					open.skipped = TRACE_EVENT_GET_SKIPPED(event->data);
+					open.tag = 0;
+					open.start = event->tsc;
+					open.childTime = 0;
+					open.blocknum = numblocks++;
+					open.parent = stack.empty() ? -1 : stack.back().blocknum;
+					open.numparents = (int)stack.size();
+					open.pending = (int)pending.size();
+					
+					TracePendingBlock_t block;
+					block.file_block.stackframe = open.site->location.crc;
+					block.file_block.tag = 0;
+					block.file_block.start = GetRelativeTicks(open.start);
+					block.file_block.end = 0;
+					block.file_block.childTime = 0;
+					block.file_block.parent = open.parent;
+					block.file_block.numparents = open.numparents;
+					block.site = open.site;
+					block.skipped = open.skipped;
+					pending.push_back(block);
+
+					stack.push_back(open);
+				}
+			}
+
+			// blocks are written in push order, anything still open is
+			// written unterminated and fixed up once it closes.
+			const auto firstblock = numblocks - (int)pending.size();
+			for (int i = 0; i < (int)pending.size(); ++i) {
+				auto& block = pending[i];
+				WriteBlock(writer, firstblock + i, block.file_block, *block.site, block.skipped);
+			}
+
+			pending.clear();
+			for (auto& open : stack) {
+				open.pending = -1;
+			}
+
+			for (const auto& block : closed) {
+				RewriteBlock(writer, block.blocknum, block.file_block, block.skipped);
+			}
+			closed.clear();
+
+			// chunks before the one being read can be freed by the capture thread.
+			ring->flushed.store(std::min(curevent, thread->blockbase), std::memory_order_release);
+#ifdef TRACE_VIRTUAL_STORAGE
+			TraceDecommitWritten(w);
+#endif
+
+			if (!thread->ended.load(std::memory_order_acquire)) {
+				return true;
+			}
+		} else if (thread->ended.load(std::memory_order_acquire)) {
+			// the thread has ended, pick up what it published on the way out.
+			if (curevent < thread->writeblocks.load(std::memory_order_acquire)) {
+				continue;
+			}
+			break;
+		} else {
+			return true;
+		}
+	}
+
+	TRACE_ASSERT(stack.empty());
+	TRACE_ASSERT(writer.numblocks == numblocks);
+
+	TraceAddSiteCalls(writer, true);
+	FinishTraceFile(writer, thread->path, thread->tsc_start - s_tscStart, thread->tsc_end - s_tscStart);
+
+	TraceFreeThread(thread);
+	delete ring;
+	return false;
+}
+#else
+// adds what the thread elided since the last call to the stack frame stats.
+static void WriteElided(TraceWriter_t& writer, TraceRing_t* ring) {
+	const auto table = ring->elided.load(std::memory_order_acquire);
+	if (!table) {
+		return;
+	}
+	const auto numsites = table->numsites.load(std::memory_order_acquire);
+	for (int i = 0; i < numsites; ++i) {
+		const auto site = table->sites[i];
+		auto& stats = table->stats[site];
+		const auto calls = stats.calls.load(std::memory_order_acquire);
+		const auto ticks = stats.ticks.load(std::memory_order_relaxed);
+		if (calls != stats.writtenCalls) {
+			auto& stackFrame = ChangeStackFrame(writer, s_sites[site]);
+			stackFrame.callCount += calls - stats.writtenCalls;
+			stackFrame.elidedCalls += calls - stats.writtenCalls;
+			stackFrame.wallTime += ticks - stats.writtenTicks;
+			stats.writtenCalls = calls;
+			stats.writtenTicks = ticks;
+		}
+	}
+}
+
+// writes what the thread has published so far, false once its file is finished.
+static bool TraceThreadWriterPump(TraceThreadWriter_t& w) {
+	auto& thread = w.thread;
+	auto& curblock = w.cursor;
+	auto& writer = w.writer;
+	auto& parents = w.parents;
+	auto& open = w.open;
+	auto& closed = w.closed;
+	auto ring = w.ring;
+
+	// rewrites the unterminated blocks that have closed and tells the
+	// capture thread which ones are still needed.
+	auto fixup = [&]() {
+		LOCK L(ring->lock);
+		auto& unterminated = ring->unterminated;
+		unterminated.clear();
+		size_t numopen = 0;
+		for (const auto& u : open) {
+			const auto* block = TraceGetBlockNum(thread, u.record);
+			// childTime is final once the pop has stored end.
+			if (const auto end = TRACE_LOAD_ACQUIRE(&block->end)) {
+				auto c = u;
+				c.file_block.end = GetRelativeTicks(end);
+				c.file_block.childTime = block->childTime;
+				closed.push_back(c);
+				if (auto p = TraceFindPinnedBlock(ring->pinned, u.record)) {
+					p->done = true;
+				}
+			} else {
+				unterminated.push_back(u.record);
+				open[numopen++] = u;
+			}
+		}
+		open.resize(numopen);
+		L.unlock();
+
+		for (const auto& block : closed) {
+			RewriteBlock(writer, block.blocknum, block.file_block, block.skipped);
+		}
+		closed.clear();
+	};
+	
+	for (;;) {
+		const auto numblocks = thread->writeblocks.load(std::memory_order_acquire);
+		if (numblocks == -1) {
+			TRACE_ASSERT(thread->next);
+			thread = thread->next;
+			continue;
+		} else if (curblock < numblocks) {
+			//trace_DebugWriteLine("--- Begin (%i blocks) ---", numblocks - curblock);
+			
+			for (; curblock < numblocks; ++curblock) {
+				const auto* block = TraceGetBlockNum(thread, curblock);
+				const auto& site = s_sites[block->site];
+				if (block->parent == TRACE_COUNTER_BLOCK) {
+					AddCounterSample(writer, site, GetRelativeTicks(block->start), block->childTime, block->skipped);
+					continue;
+				}
+
+				block_t file_block;
+				file_block.stackframe = site.location.crc;
+				file_block.tag = block->tag;
+				file_block.start = GetRelativeTicks(block->start);
+				const auto end = TRACE_LOAD_ACQUIRE(&block->end);
+				file_block.end = end ? GetRelativeTicks(end) : 0;
+				file_block.childTime = end ? block->childTime : 0;
+
+				// blocks come in push order so the parent is always on the
+				// stack, popping what ended before it keeps this O(1) per block.
+				while (!parents.empty() && (parents.back().record != block->parent)) {
+					parents.pop_back();
+				}
+				TRACE_ASSERT(parents.empty() == (block->parent == -1));
+
+				file_block.parent = parents.empty() ? -1 : parents.back().blocknum;
+				file_block.numparents = parents.empty() ? 0 : parents.back().numparents + 1;
+
+				const auto blocknum = writer.numblocks;
+
+				TraceParent_t parent;
+				parent.record = curblock;
+				parent.blocknum = blocknum;
+				parent.numparents = file_block.numparents;
+				parents.push_back(parent);
+
+				if (!file_block.end) {
+					TraceUnterminatedBlock_t u;
+					u.file_block = file_block;
+					u.blocknum = blocknum;
+					u.record = curblock;
+					u.skipped = block->skipped;
+					open.push_back(u);
+				}
+
+				WriteBlock(writer, blocknum, file_block, site, block->skipped);
+			}
+
+			fixup();
+
+			// chunks before the one being read can be freed by the capture thread.
+			ring->flushed.store(std::min(curblock, thread->blockbase), std::memory_order_release);
+#ifdef TRACE_VIRTUAL_STORAGE
+			TraceDecommitWritten(w);
+#endif
+
+			//trace_DebugWriteLine("--- End (%i blocks) ---", numblocks - curblock);
+			if (!thread->ended.load(std::memory_order_acquire)) {
+				return true;
+			}
+		} else if (thread->ended.load(std::memory_order_acquire)) {
+			// the thread has ended, pick up what it published on the way out.
+			if (curblock < thread->writeblocks.load(std::memory_order_acquire)) {
+				continue;
+			}
+			break;
+		} else {
+			return true;
+		}
+	}
+
+	fixup();
+	TRACE_ASSERT(open.empty());
+
+	TRACE_ASSERT(writer.numblocks + writer.numsamples == thread->writeblocks);
+
+	WriteElided(writer, ring);
+	TraceAddSiteCalls(writer, true);
+	FinishTraceFile(writer, thread->path, thread->tsc_start - s_tscStart, thread->tsc_end - s_tscStart);
+
+	TraceFreeThread(thread);
+	delete ring;
+	return false;
+}
+#endif
+
+static double s_writerCpuSeconds = 0;
+
+static double TraceThreadCpuSeconds() {
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	const auto ticks = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) + (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);
+	return ticks * 1e-7;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+double TraceGetWriterCpuSeconds() {
+	LOCK L(M);
+	return s_writerCpuSeconds;
+}
+
+// The writer pool. Each pass services every thread that has something
+// published once, a pass starts when a thread wakes the pool (every
+// TRACE_WRITER_BATCH records and when it ends) or after TRACE_WRITER_LATENCY
+// ms so the odd few records don't sit in memory forever.
+static void TraceWriterThread() {
+	TraceConfigureWriterThread();
+
+	LOCK L(M);
+	auto pass = s_writerPass;
+	for (;;) {
+		TraceThreadWriter_t* w = nullptr;
+		for (auto it : s_threadWriters) {
+			if (!it->busy && (it->pass != pass) && TraceThreadWriterReady(*it)) {
+				w = it;
+				break;
+			}
+		}
+
+		if (w) {
+			w->busy = true;
+			w->pass = pass;
+			L.unlock();
+			const auto more = TraceThreadWriterPump(*w);
+			if (more && CheckpointDue(w->writer)) {
+#ifndef TRACE_COMPACT_EVENTS
+				WriteElided(w->writer, w->ring);
+#endif
+				TraceAddSiteCalls(w->writer, false);
+				WriteCheckpoint(w->writer, GetRelativeTicks(TRACE_RDTSC()), false);
+			}
+			L.lock();
+			w->busy = false;
+			if (!more) {
+				s_threadWriters.erase(std::find(s_threadWriters.begin(), s_threadWriters.end(), w));
+				delete w;
+			}
+			continue;
+		}
+
+		if (s_writerQuit && s_threadWriters.empty()) {
+			s_writerCpuSeconds += TraceThreadCpuSeconds();
+			break;
+		}
+
+		if (!s_writerCV.wait_for(L, std::chrono::milliseconds(TRACE_WRITER_LATENCY), [pass] { return (s_writerPass != pass) || (s_writerQuit && s_threadWriters.empty()); })) {
+			++s_writerPass;
+		}
+		pass = s_writerPass;
+	}
+}
+static void TraceWakeWriterPool() {
+	{
+		LOCK L(M);
+		++s_writerPass;
+	}
+	s_writerCV.notify_one();
+}
+
+void TraceWakeWriter(TraceThread_t* thread) {
+	thread->notifyblocks = thread->numblocks + TRACE_WRITER_BATCH;
+	TraceWakeWriterPool();
+}
+#endif
+
+#ifdef TRACE_AGGREGATE
+// The reporter's file and the threads it adds up, all under s_aggregateLock.
+// Totals are kept by stack frame, the order the writer added them in.
+// Threads that have ended leave theirs in s_aggregateEnded.
+static std::mutex s_aggregateLock;
+static std::condition_variable s_aggregateCV;
+static std::thread s_aggregateThread;
+static bool s_aggregateQuit = false;
+static TraceWriter_t* s_aggregateWriter;
+static char s_aggregatePath[1100];
+static std::vector<TraceRing_t*> s_aggregateRings;
+static std::vector<TraceAggregateSum_t> s_aggregateEnded;
+static std::vector<TraceAggregateSum_t> s_aggregateTotals;
+
+static void TraceAggregateMerge(TraceAggregateSum_t& sum, uint64_t calls, uint64_t ticks, uint64_t childTicks, uint64_t minTicks, uint64_t maxTicks, uint64_t sampledCalls, uint64_t sampledTicks, uint64_t skippedCalls) {
+	if (!calls) {
+		return;
+	}
+	sum.minTicks = sum.calls ? std::min(sum.minTicks, minTicks) : minTicks;
+	sum.maxTicks = std::max(sum.maxTicks, maxTicks);
+	sum.calls += calls;
+	sum.ticks += ticks;
+	sum.childTicks += childTicks;
+	sum.sampledCalls += sampledCalls;
+	sum.sampledTicks += sampledTicks;
+	sum.skippedCalls += skippedCalls;
+}
+
+// adds what one thread has so far to sums. A site is listed before its
+// first call has stored its stats, calls is loaded first so the rest are at
+// least from that call.
+static void TraceAggregateMergeThread(std::vector<TraceAggregateSum_t>& sums, TraceRing_t* ring) {
+	auto& writer = *s_aggregateWriter;
+	const auto table = ring->aggregate.load(std::memory_order_acquire);
+	if (!table) {
+		return;
+	}
+	const auto numsites = table->numsites.load(std::memory_order_acquire);
+	for (int i = 0; i < numsites; ++i) {
+		const auto site = table->sites[i];
+		const auto& stats = table->stats[site];
+		const auto calls = stats.calls.load(std::memory_order_acquire);
+		if (!calls) {
+			continue;
+		}
+		auto idx = TraceCrcFind(writer.stackFrameTable, s_sites[site].location.crc);
+		if (idx < 0) {
+			ChangeStackFrame(writer, s_sites[site]);
+			idx = (int)writer.stackFrames.size() - 1;
+		}
+		if ((int)sums.size() <= idx) {
+			sums.resize(idx + 1);
+		}
+		TraceAggregateMerge(sums[idx], calls,
+			stats.ticks.load(std::memory_order_relaxed),
+			stats.childTicks.load(std::memory_order_relaxed),
+			stats.minTicks.load(std::memory_order_relaxed),
+			stats.maxTicks.load(std::memory_order_relaxed),
+			stats.sampledCalls.load(std::memory_order_relaxed),
+			stats.sampledTicks.load(std::memory_order_relaxed),
+			stats.skippedCalls.load(std::memory_order_relaxed));
+	}
+}
+
+// adds up every thread and appends the stack frames that changed since the
+// last report. There are no blocks so best and worst calls stay -1.
+static void TraceAggregateReport(bool final) {
+	auto& writer = *s_aggregateWriter;
+	auto& totals = s_aggregateTotals;
+	totals = s_aggregateEnded;
+	for (auto ring : s_aggregateRings) {
+		TraceAggregateMergeThread(totals, ring);
+	}
+
+	for (int i = 0; i < (int)totals.size(); ++i) {
+		const auto& sum = totals[i];
+		const auto& frame = writer.stackFrames[i];
+		if (!sum.calls || ((frame.callCount == sum.calls) && (frame.wallTime == sum.ticks))) {
+			continue;
+		}
+		auto& stackFrame = ChangeStackFrame(writer, i);
+		stackFrame.callCount = sum.calls;
+		stackFrame.wallTime = sum.ticks;
+		stackFrame.childTime = sum.childTicks;
+		stackFrame.bestCallTime = sum.minTicks;
+		stackFrame.worstCallTime = sum.maxTicks;
+		stackFrame.sampledCalls = sum.sampledCalls;
+		stackFrame.sampledTime = sum.sampledTicks;
+		stackFrame.skippedCalls = sum.skippedCalls;
+	}
+
+	const auto now = GetRelativeTicks(TRACE_RDTSC());
+	writer.lastTick = now;
+	TraceAddSiteCalls(writer, final);
+	if (final) {
+		WriteCheckpoint(writer, now, true);
+		TraceOutputClose(writer.out);
+		trace_DebugWriteLine("Trace: wrote %i sites to [%s].", (int)writer.stackFrames.size(), s_aggregatePath);
+	} else if (!writer.changed.empty()) {
+		WriteCheckpoint(writer, now, false);
+	}
+}
+
+static void TraceAggregateThread() {
+	TraceConfigureWriterThread();
+
+	LOCK L(s_aggregateLock);
+	while (!s_aggregateCV.wait_for(L, std::chrono::milliseconds(TRACE_AGGREGATE_INTERVAL), [] { return s_aggregateQuit; })) {
+		TraceAggregateReport(false);
+	}
+}
+
+static void TraceAggregateBegin() {
+	sprintf_s(s_aggregatePath, "%s.aggregate.trace", &s_tracePath[0]);
+
+	LOCK L(s_aggregateLock);
+	s_aggregateWriter = new TraceWriter_t();
+	const auto opened = BeginTraceFile(*s_aggregateWriter, s_aggregatePath, 0);
+	TRACE_VERIFY(opened);
+	trace_DebugWriteLine("TraceProfiler opened [%s]", s_aggregatePath);
+	s_aggregateEnded.clear();
+	s_aggregateQuit = false;
+	s_aggregateThread = std::thread(TraceAggregateThread);
+}
+
+static void TraceAggregateEnd() {
+	{
+		LOCK L(s_aggregateLock);
+		s_aggregateQuit = true;
+	}
+	s_aggregateCV.notify_all();
+	s_aggregateThread.join();
+
+	LOCK L(s_aggregateLock);
+	TraceAggregateReport(true);
+	delete s_aggregateWriter;
+	s_aggregateWriter = nullptr;
+}
+#endif
+
+#ifdef TRACE_FLIGHT_RECORDER
+struct TraceTrigger_t {
+	uint64_t tsc;
+	char reason[256];
+};
+
+static constexpr TraceSite_t s_triggerSite = { trace_crcstr_t("TraceTrigger()"), trace_crcstr_t(__FILE__ ":" TRACE_STRINGIZE(__LINE__)), 0 };
+static std::condition_variable s_triggerCV;
+static std::thread s_triggerThread;
+static TraceTrigger_t s_trigger;
+static bool s_triggerPending = false;
+static bool s_triggerQuit = false;
+static int s_triggerCount = 0;
+static uint32_t s_preRollMillis = TRACE_TRIGGER_PREROLL;
+static uint32_t s_postRollMillis = TRACE_TRIGGER_POSTROLL;
+
+struct TraceSnapshot_t {
+	char path[1024];
+	uint64_t tsc;
+	// pinned blocks followed by the resident ones, parents are
+	// indices into this array.
+	std::vector<TraceBlock_t> blocks;
+};
+
+// the thread may pop the block while it is copied, its childTime is only
+// final once end is set.
+static void TraceFlightCopyBlock(std::vector<TraceBlock_t>& blocks, const TraceBlock_t& from) {
+	TraceBlock_t block;
+	block.site = from.site;
+	block.skipped = from.skipped;
+	block.start = from.start;
+	block.parent = from.parent;
+	block.tag = from.tag;
+	block.end = TRACE_LOAD_ACQUIRE(&from.end);
+	block.childTime = block.end ? from.childTime : 0;
+	blocks.push_back(block);
+}
+
+// only the trigger's own copy releases the hold TraceTrigger() put on the ring.
+static void TraceFlightCopy(TraceRing_t* ring, const char* path, TraceSnapshot_t& snapshot, bool trigger) {
+	sprintf_s(snapshot.path, "%s.%s.%u.trace", path, ring->name, ring->id);
+
+	TraceThread_t* thread;
+	int base;
+	int numblocks;
+	std::vector<int> pinned;
+	auto& blocks = snapshot.blocks;
+
+	{
+		LOCK L(ring->lock);
+		if (trigger) {
+			ring->hold = false;
+		}
+		ring->copying = true;
+
+		thread = ring->newest;
+		base = ring->oldest->blockbase;
+		// every push and pop publishes the blocks written so far.
+		numblocks = thread->writeblocks.load(std::memory_order_acquire);
+		snapshot.tsc = TRACE_RDTSC();
+
+		blocks.reserve(ring->pinned.size() + std::max(numblocks - base, 0));
+		for (const auto& p : ring->pinned) {
+			pinned.push_back(p.blocknum);
+			TraceFlightCopyBlock(blocks, p.block);
+		}
+	}
+
+	// the chunks stay put while copying is set, the traced thread doesn't
+	// wait for the copy.
+	for (int i = base; i < numblocks; ++i) {
+		TraceFlightCopyBlock(blocks, *TraceGetBlockNum(thread, i));
+	}
+
+	{
+		LOCK L(ring->lock);
+		ring->copying = false;
+	}
+
+	const auto numpinned = (int)pinned.size();
+
+	for (auto& block : blocks) {
+		const auto parent = block.parent;
+		if (parent == TRACE_COUNTER_BLOCK) {
+			continue;
+		} else if (parent < 0) {
+			block.parent = -1;
+		} else if (parent >= base) {
+			block.parent = parent - base + numpinned;
+		} else {
+			// parents that were recycled make their children roots.
+			const auto pos = std::lower_bound(pinned.begin(), pinned.end(), parent);
+			block.parent = ((pos != pinned.end()) && (*pos == parent)) ? (int)(pos - pinned.begin()) : -1;
+		}
+	}
+}
+
+// blocks that ended before cutoff are left out, a trigger adds a
+// marker block tagged with its reason.
+static void TraceFlightWrite(const TraceSnapshot_t& snapshot, uint64_t cutoff, const TraceTrigger_t* trigger) {
+	TraceWriter_t writer;
+	if (!BeginTraceFile(writer, snapshot.path, 0)) {
+		trace_DebugWriteLine("Trace: failed to open [%s].", snapshot.path);
+		return;
+	}
+
+	const auto& blocks = snapshot.blocks;
+	const auto tick_end = GetRelativeTicks(snapshot.tsc);
+	auto tick_start = tick_end;
+	std::vector<int> blocknums(blocks.size());
+	std::vector<int> numparents;
+	int numblocks = 0;
+
+	// the child time of scopes that were still open is what their children
+	// in the snapshot add up to.
+	std::vector<uint64_t> openChildTime(blocks.size(), 0);
+	for (const auto& block : blocks) {
+		if ((block.parent >= 0) && !((blocks[block.parent].end != 0) && (blocks[block.parent].end < snapshot.tsc))) {
+			const auto closed = (block.end != 0) && (block.end < snapshot.tsc);
+			openChildTime[block.parent] += (closed ? block.end : snapshot.tsc) - block.start;
+		}
+	}
+
+	for (int i = 0; i < (int)blocks.size(); ++i) {
+		const auto& block = blocks[i];
+		const auto closed = (block.end != 0) && (block.end < snapshot.tsc);
+
+		if ((block.parent == TRACE_COUNTER_BLOCK) || (closed && (block.end < cutoff))) {
+			if ((block.parent == TRACE_COUNTER_BLOCK) && (block.start >= cutoff) && (block.start < snapshot.tsc)) {
+				const auto tick = GetRelativeTicks(block.start);
+				tick_start = std::min(tick_start, tick);
+				AddCounterSample(writer, s_sites[block.site], tick, block.childTime, block.skipped);
+			}
+			blocknums[i] = -1;
+			continue;
+		}
+
+		const auto parent = (block.parent != -1) ? blocknums[block.parent] : -1;
+
+		block_t file_block;
+
+		const auto& site = s_sites[block.site];
+		file_block.stackframe = site.location.crc;
+		file_block.tag = block.tag;
+		file_block.start = GetRelativeTicks(block.start);
+		// scopes that were still open when the snapshot was taken end at the snapshot.
+		file_block.end = GetRelativeTicks(closed ? block.end : snapshot.tsc);
+		file_block.childTime = closed ? block.childTime : openChildTime[i];
+		file_block.parent = parent;
+		file_block.numparents = (parent != -1) ? numparents[parent] + 1 : 0;
+		numparents.push_back(file_block.numparents);
+		blocknums[i] = numblocks;
+
+		tick_start = std::min(tick_start, file_block.start);
+
+		WriteBlock(writer, numblocks++, file_block, site, block.skipped);
+	}
+
+	if (trigger) {
+		block_t file_block;
+		file_block.stackframe = s_triggerSite.location.crc;
+		file_block.tag = TraceInternTag(trace_crcstr_t(trigger->reason, trace_crc_runtime_tag));
+		file_block.start = GetRelativeTicks(trigger->tsc);
+		file_block.end = file_block.start;
+		file_block.childTime = 0;
+		file_block.parent = -1;
+		file_block.numparents = 0;
+
+		tick_start = std::min(tick_start, file_block.start);
+
+		WriteBlock(writer, numblocks++, file_block, s_triggerSite, 0);
+	}
+
+	FinishTraceFile(writer, snapshot.path, tick_start, tick_end);
+}
+
+void TraceWriteSnapshot(const char* path) {
+	char prefix[1024];
+	if (!path) {
+		sprintf_s(prefix, "%s.snapshot%04i", &s_tracePath[0], s_snapshotCount++);
+		path = prefix;
+	}
+
+	std::vector<TraceSnapshot_t> snapshots;
+	{
+		LOCK L(M);
+		snapshots.resize(s_rings.size());
+		for (size_t i = 0; i < s_rings.size(); ++i) {
+			TraceFlightCopy(s_rings[i], path, snapshots[i], false);
+		}
+	}
+
+	for (const auto& snapshot : snapshots) {
+		TraceFlightWrite(snapshot, 0, nullptr);
+	}
+}
+
+void TraceSetTrigger(uint32_t preRollMillis, uint32_t postRollMillis) {
+	LOCK L(M);
+	s_preRollMillis = preRollMillis;
+	s_postRollMillis = postRollMillis;
+}
+
+static void TraceTriggerThread() {
+	TraceConfigureWriterThread();
+
+	LOCK L(M);
+	for (;;) {
+		s_triggerCV.wait(L, [] { return s_triggerPending || s_triggerQuit; });
+		if (!s_triggerPending) {
+			break;
+		}
+
+		// keep recording the post-roll, cut short by TraceShutdown().
+		const auto postRoll = std::chrono::steady_clock::now() + std::chrono::milliseconds(s_postRollMillis);
+		s_triggerCV.wait_until(L, postRoll, [] { return s_triggerQuit; });
+
+		const auto trigger = s_trigger;
+		const auto preRoll = std::min<uint64_t>(trigger.tsc, s_preRollMillis * TraceTicksPerMilli());
+
+		char prefix[1024];
+		sprintf_s(prefix, "%s.trigger%04i", &s_tracePath[0], s_triggerCount++);
+
+		std::vector<TraceSnapshot_t> snapshots(s_rings.size());
+		for (size_t i = 0; i < s_rings.size(); ++i) {
+			TraceFlightCopy(s_rings[i], prefix, snapshots[i], true);
+		}
+
+		// triggers that fire from here on start a new capture.
+		s_triggerPending = false;
+		L.unlock();
+
+		trace_DebugWriteLine("Trace: writing trigger [%s]...", trigger.reason);
+		for (const auto& snapshot : snapshots) {
+			TraceFlightWrite(snapshot, trigger.tsc - preRoll, &trigger);
+		}
+
+		L.lock();
+	}
+}
+
+void TraceTrigger(const char* reason) {
+	const auto tsc = TRACE_RDTSC();
+
+	LOCK L(M);
+	if (s_triggerPending) {
+		// already capturing, this one is inside its post-roll.
+		return;
+	}
+
+	s_triggerPending = true;
+	s_trigger.tsc = tsc;
+	sprintf_s(s_trigger.reason, "%.255s", reason ? reason : "");
+
+	for (auto ring : s_rings) {
+		LOCK R(ring->lock);
+		ring->hold = true;
+	}
+
+	if (!s_triggerThread.joinable()) {
+		s_triggerThread = std::thread(TraceTriggerThread);
+	}
+	s_triggerCV.notify_one();
+}
+#endif
+
+#ifdef TRACE_COMPACT_EVENTS
+void TraceThreadReset(int reset) {
+#if !defined(TRACE_MANUAL_COMMIT) && !defined(TRACE_FLIGHT_RECORDER)
+	// the writers may already have what a reset would take back.
+	TRACE_ASSERT(!"TraceThreadReset() needs TRACE_MANUAL_COMMIT or TRACE_FLIGHT_RECORDER");
+	return;
+#endif
+	auto thread = __tr_thread;
+	if (thread && (thread->reset < reset) && (thread->blockbase == 0)) {
+		// keep the begin (and tag) events of the scopes that are still open.
+		std::vector<int> open;
+		for (int i = 0; i < thread->numblocks; ++i) {
+			const auto data = thread->_events[i].data;
+			if (data == TRACE_EVENT_END) {
+				open.pop_back();
+			} else if ((data & 3) == TRACE_EVENT_COUNTER) {
+				++i; // and its value
+			} else if (data != TRACE_EVENT_TAG) {
+				open.push_back(i);
+			}
+		}
+
+		if (open.empty()) {
+			return;
+		}
+
+		int numevents = 0;
+		for (const auto i : open) {
+			thread->_events[numevents++] = thread->_events[i];
+			if (((i + 1) < thread->numblocks) && (thread->_events[i + 1].data == TRACE_EVENT_TAG)) {
+				thread->_events[numevents++] = thread->_events[i + 1];
+			}
+		}
+
+		thread->tsc_start = TRACE_RDTSC();
+		thread->tsc_end = 0;
+		thread->reset = reset;
+		thread->numblocks = numevents;
+	}
+}
+#else
+void TraceThreadReset(int reset) {
+#if !defined(TRACE_MANUAL_COMMIT) && !defined(TRACE_FLIGHT_RECORDER)
+	// the writers may already have what a reset would take back.
+	TRACE_ASSERT(!"TraceThreadReset() needs TRACE_MANUAL_COMMIT or TRACE_FLIGHT_RECORDER");
+	return;
+#endif
+	auto thread = __tr_thread;
+	if (thread && (thread->reset < reset) && (thread->blockbase == 0) && (thread->stack >= 0)) {
+		thread->tsc_start = TRACE_RDTSC();
+		thread->tsc_end = 0;
 		thread->reset = reset;
 		thread->numblocks = thread->stack + 1;
 		thread->_blocks[thread->stack].childTime = 0;
 	}
 }
+#endif
 
 void TraceBeginThread(const char* name, uint32_t id) {
 
 	TRACE_ASSERT(!__tr_thread);
 	TRACE_VERIFY(s_init);
 	
+#ifdef __linux__
+	// names the OS thread too so perf and gdb match the trace files, the
+	// kernel keeps 15 characters.
+	char osname[16];
+	strcpy_s(osname, name);
+	pthread_setname_np(pthread_self(), osname);
+#endif
+
 	auto thread = TraceThreadGrow();
 	thread->id = id;
 	thread->numblocks = 0;
+	thread->notifyblocks = TRACE_WRITER_BATCH;
 	thread->stack = -1;
-	thread->micro_start = GetMicroseconds();
-	//thread->tsc_start = TRACE_RDTSC();
+	thread->tsc_start = TRACE_RDTSC();
+
+	auto ring = new TraceRing_t();
+	ring->oldest = thread;
+	ring->flushed.store(0, std::memory_order_relaxed);
+	thread->ring = ring;
+
+#ifdef TRACE_FLIGHT_RECORDER
+	// nothing goes to disk until TraceWriteSnapshot().
+	ring->hold = false;
+	ring->copying = false;
+	ring->newest = thread;
+	ring->numchunks = 1;
+	ring->id = id;
+	strcpy_s(ring->name, name);
+	thread->path[0] = 0;
+	s_flightBytes += TRACE_CHUNK_BYTES;
 
-	sprintf_s(thread->path, "%s.%s.%u.trace", &s_tracePath[0], name, id);
+	LOCK L(M);
+	s_rings.push_back(ring);
+#elif defined(TRACE_AGGREGATE)
+	// nothing is written per thread, the reporter adds it up.
+	thread->path[0] = 0;
 
-#ifdef _WIN32
-	if (fopen_s(&thread->fp, thread->path, "wb")) {
-		thread->fp = nullptr;
-	}
+	LOCK L(s_aggregateLock);
+	s_aggregateRings.push_back(ring);
 #else
-	thread->fp = fopen(thread->path, "wb");
-#endif
+	sprintf_s(thread->path, "%s.%s.%u.trace", &s_tracePath[0], name, id);
 
-	TRACE_VERIFY(thread->fp);
+	auto w = TraceNewThreadWriter(thread);
 	trace_DebugWriteLine("TraceProfiler opened [%s]", thread->path);
-	
+
 	LOCK L(M);
-	s_writeThreads.push_back(std::thread(TraceThreadWriter, thread));
+	w->pass = s_writerPass - 1;
+	s_threadWriters.push_back(w);
+	if (s_writerThreads.empty()) {
+		for (int i = 0; i < s_numWriterThreads; ++i) {
+			s_writerThreads.push_back(std::thread(TraceWriterThread));
+		}
+	}
+#endif
 }
 
 void TraceEndThread() {
@@ -532,16 +3661,49 @@ void TraceEndThread() {
 	TRACE_ASSERT(thread);
 	TRACE_ASSERT(thread->stack == -1);
 	
-	thread->micro_end = GetMicroseconds();
-	//thread->tsc_end = TRACE_RDTSC();
-	thread->stack = -2;
+	thread->tsc_end = TRACE_RDTSC();
+#ifdef TRACE_FLIGHT_RECORDER
+	auto ring = thread->ring;
+	{
+		LOCK L(M);
+		s_rings.erase(std::find(s_rings.begin(), s_rings.end(), ring));
+	}
+	s_flightBytes -= ring->numchunks * TRACE_CHUNK_BYTES;
+	TraceFreeThread(thread);
+	delete ring;
+	__tr_thread = nullptr;
+#elif defined(TRACE_AGGREGATE)
+	auto ring = thread->ring;
+	{
+		LOCK L(s_aggregateLock);
+		s_aggregateRings.erase(std::find(s_aggregateRings.begin(), s_aggregateRings.end(), ring));
+		if (s_aggregateWriter) {
+			TraceAggregateMergeThread(s_aggregateEnded, ring);
+		}
+	}
+	TraceFreeThread(thread);
+	delete ring;
+	__tr_thread = nullptr;
+#else
 	thread->writeblocks.store(thread->numblocks, std::memory_order_release);
-	thread = nullptr;
+	__tr_thread = nullptr;
+	thread->ended.store(true, std::memory_order_release);
+	// the pool may free the thread from here on.
+	TraceWakeWriterPool();
+#endif
 }
 
 uint32_t TraceGetCurrentThreadID() {
 #ifdef _WIN32
 	return (uint32_t)GetCurrentThreadId();
+#elif defined(__linux__)
+	return (uint32_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+	uint64_t id;
+	pthread_threadid_np(nullptr, &id);
+	return (uint32_t)id;
+#else
+	return (uint32_t)(uintptr_t)pthread_self();
 #endif
 }
 
@@ -550,39 +3712,57 @@ void TraceInit(const char* path) {
 
 	if (!s_init) {
 		s_init = true;
-		const auto micro_start = GetMicroseconds();
-		const auto tsc_start = TRACE_RDTSC();
-
-		uint64_t micro_end;
-		uint64_t tsc_end;
-
-		for (;;) {
-			tsc_end = TRACE_RDTSC();
-			micro_end = GetMicroseconds();
-			if ((micro_end - micro_start) > 100000) {
-				break;
-			}
-		}
-
-		s_ticksPerMicro = (tsc_end - tsc_start) / (micro_end - micro_start);
+		s_ticksPerSecond = TraceQueryTicksPerSecond();
+#if !defined(TRACE_CLOCK_MONOTONIC) && defined(__linux__)
+		TraceCheckTSC();
+#endif
 
-#ifdef _WIN32
 		strcpy_s(s_tracePath, path);
-#else
-		strcpy(&s_tracePath[0], path);
-#endif
 		s_tscStart = TRACE_RDTSC();
-		s_microStart = GetMicroseconds();
+		s_nanoStart = GetNanoseconds();
+		{
+			LOCK L(s_syncLock);
+			s_syncPoints.clear();
+			s_calibratedTicksPerMilli.store(0, std::memory_order_relaxed);
+			TraceAddSyncPoint();
+		}
+#ifdef TRACE_WRITER_POOL
+		s_writerQuit = false;
+#endif
+#ifdef TRACE_AGGREGATE
+		TraceAggregateBegin();
+#endif
 	}
 }
 
 void TraceShutdown() {
 	trace_DebugWriteLine("TraceProfiler flushing trace data...");
 	s_init = false;
-	LOCK L(M);
-	for (auto& thread : s_writeThreads) {
+#ifdef TRACE_FLIGHT_RECORDER
+	{
+		LOCK L(M);
+		s_triggerQuit = true;
+		s_triggerCV.notify_all();
+	}
+	if (s_triggerThread.joinable()) {
+		s_triggerThread.join();
+	}
+#endif
+#ifdef TRACE_WRITER_POOL
+	std::vector<std::thread> threads;
+	{
+		LOCK L(M);
+		s_writerQuit = true;
+		threads.swap(s_writerThreads);
+	}
+	s_writerCV.notify_all();
+	for (auto& thread : threads) {
 		thread.join();
 	}
+#endif
+#ifdef TRACE_AGGREGATE
+	TraceAggregateEnd();
+#endif
 	trace_DebugWriteLine("TraceProfiler done.");
 }
 
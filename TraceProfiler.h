@@ -13,7 +13,9 @@
 #pragma warning(disable:4365 4548 4774)
 #endif
 #include <stdint.h>
+#include <stddef.h>
 #include <atomic>
+#include <type_traits>
 
 #ifndef TRACE_ASSERT
 #define __TRACE_DEFINED_ASSERT
@@ -31,10 +33,27 @@
 #define TRACE_DLL_EXPORT
 #endif
 #else
+#define THREAD_LOCAL __thread
 #define TRACE_DLL_IMPORT
 #define TRACE_DLL_EXPORT
 #endif
 
+// TRACE_CLOCK_MONOTONIC timestamps with clock_gettime(CLOCK_MONOTONIC_RAW)
+// rather than rdtsc, for machines without a usable TSC. Non-x86 POSIX targets
+// always do.
+#if !defined(_WIN32) && !defined(TRACE_CLOCK_MONOTONIC) && !(defined(__x86_64__) || defined(__i386__))
+#define TRACE_CLOCK_MONOTONIC
+#endif
+
+#ifdef TRACE_CLOCK_MONOTONIC
+#ifdef _WIN32
+#error "TRACE_CLOCK_MONOTONIC needs clock_gettime()"
+#endif
+#include <time.h>
+#elif !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
 #ifndef TRACE_API
 #ifdef BUILDING_TRACE_PROFILER
 #define TRACE_API TRACE_DLL_EXPORT
@@ -50,7 +69,28 @@
 #pragma warning(pop)
 #endif
 
+#ifdef TRACE_CLOCK_MONOTONIC
+static inline uint64_t TraceMonotonicNanos() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#define TRACE_RDTSC() TraceMonotonicNanos()
+#else
 #define TRACE_RDTSC() __rdtsc()
+#endif
+
+// A block's end is stored while other threads may be reading the block. The
+// release store orders the block's childTime (its children all popped before
+// it) ahead of end, readers acquire end and only trust childTime once it is set.
+#ifdef _MSC_VER
+// volatile has acquire/release semantics with /volatile:ms (the x86/x64 default).
+#define TRACE_STORE_RELEASE(_p, _v) (*(volatile uint64_t*)(_p) = (_v))
+#define TRACE_LOAD_ACQUIRE(_p) (*(const volatile uint64_t*)(_p))
+#else
+#define TRACE_STORE_RELEASE(_p, _v) __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#define TRACE_LOAD_ACQUIRE(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#endif
 
 class TraceNotCopyable {
 public:
@@ -443,30 +483,275 @@ private:
 
 static constexpr trace_crcstr_t trace_crcstr_null(trace_crc_null_tag);
 
-struct TraceBlock_t {
+/*
+===============================================================================
+Call sites
+
+Every TRACE()/TRBLOCK()/TRLABEL() registers its label and location once, at
+static initialization, into a process wide table of TRACE_MAX_SITES sites
+and records only carry the 16 bit id. Sites with the same label and location
+(template instantiations for instance) share an id. A site that registers
+after the table is full, or is hit before its registration ran (from another
+static initializer), records TRACE_SITE_UNREGISTERED.
+
+Sites can be switched off and on while the process runs, a switched off site
+skips its push and pop (and its tag lookup) after checking a single byte.
+Blocks that were already open when their site was switched off still pop.
+
+Sites belong to one of TRACE_MAX_CATEGORIES categories, 0 unless they use
+one of the _CAT() macros. Categories that aren't in TRACE_CATEGORY_MASK
+(define it globally, every category by default) compile to nothing like the
+macros do without TRACE_PROFILER, the others can be switched together with
+TraceSetCategoryMask(). Category names are written to the trace files.
+
+With TraceSetSampling() the writer threads measure how often each site is
+called, a site that goes over the rate records about 1 in N calls (at random
+so calls in a fixed pattern aren't always the same one) and each recorded
+block carries how many calls it stands for. That is the same single byte
+check for the sites that aren't sampled.
+===============================================================================
+*/
+
+#define TRACE_MAX_CATEGORIES 32
+
+#ifndef TRACE_CATEGORY_MASK
+#define TRACE_CATEGORY_MASK 0xffffffffu
+#endif
+
+#define TRACE_CATEGORY_COMPILED(_cat) ((((uint32_t)TRACE_CATEGORY_MASK) >> (_cat)) & 1)
+
+#define TRACE_MAX_SITES (64 * 1024)
+#define TRACE_MAX_SAMPLE_PERIOD (32 * 1024)
+#define TRACE_SITE_UNREGISTERED 0
+#define TRACE_SITE_UNREGISTERED_STRING "<unregistered site>"
+
+struct TraceSite_t {
 	trace_crcstr_t label;
 	trace_crcstr_t location;
-	const char* tag;
+	int category;
+};
+
+// __tr_siteDisabled bits
+enum {
+	TRACE_SITE_DISABLED = 1, // TraceSetSiteEnabled()
+	TRACE_SITE_CATEGORY_DISABLED = 2, // TraceSetCategoryMask()
+	TRACE_SITE_SAMPLED = 4 // TraceSetSampling()
+};
+
+TRACE_API uint16_t TraceRegisterSite(trace_crcstr_t label, trace_crcstr_t location, int category = 0);
+// sites registered so far are 1 to TraceGetNumSites() - 1.
+TRACE_API int TraceGetNumSites();
+TRACE_API const TraceSite_t* TraceGetSite(uint16_t site);
+TRACE_API void TraceSetSiteEnabled(uint16_t site, bool enabled);
+// switches every registered site whose label or location is str, returns how many matched.
+TRACE_API int TraceSetSitesEnabled(const char* str, bool enabled);
+// bit n enables category n, every category is enabled to begin with.
+TRACE_API void TraceSetCategoryMask(uint32_t mask);
+TRACE_API uint32_t TraceGetCategoryMask();
+// the name written to the trace files, "category <n>" if it isn't set.
+TRACE_API void TraceSetCategoryName(int category, const char* name);
+// Leaf blocks shorter than nanos (0 to record everything, the default) are
+// dropped when they pop and only counted per site, their time still goes to
+// the parent. TraceSetElideThreshold() sets every site, registered or not,
+// call it after TraceInit(). Not in TRACE_COMPACT_EVENTS or
+// TRACE_FLIGHT_RECORDER builds.
+TRACE_API void TraceSetElideThreshold(uint32_t nanos);
+TRACE_API void TraceSetSiteElideThreshold(uint16_t site, uint32_t nanos);
+#ifndef TRACE_FLIGHT_RECORDER
+// Sites called more than callsPerSecond times a second (all threads
+// together) only record about budgetPerSecond calls a second, the period is
+// picked again every TRACE_SAMPLE_INTERVAL ms. 0 records every call, the
+// default.
+TRACE_API void TraceSetSampling(uint32_t callsPerSecond, uint32_t budgetPerSecond);
+#endif
+// records about 1 in period calls of one site (up to TRACE_MAX_SAMPLE_PERIOD,
+// 1 for all of them) until TraceSetSampling() picks a period for it.
+TRACE_API void TraceSetSiteSamplePeriod(uint16_t site, uint32_t period);
+// -1 to skip the call, otherwise how many calls were skipped before it.
+TRACE_API int TraceSample(uint16_t site);
+
+extern TRACE_API std::atomic<uint8_t> __tr_siteDisabled[TRACE_MAX_SITES];
+extern TRACE_API std::atomic<uint32_t> __tr_siteElideTicks[TRACE_MAX_SITES];
+
+inline bool TraceSiteEnabled(uint16_t site) {
+	return !(__tr_siteDisabled[site].load(std::memory_order_relaxed) & (TRACE_SITE_DISABLED | TRACE_SITE_CATEGORY_DISABLED));
+}
+
+// what TraceSample() returns, sites that aren't sampled don't call it.
+inline int TraceSiteSample(uint16_t site) {
+	const auto state = __tr_siteDisabled[site].load(std::memory_order_relaxed);
+	return !state ? 0 : ((state == TRACE_SITE_SAMPLED) ? TraceSample(site) : -1);
+}
+
+// Site has static label(), location() and category() functions, the id is
+// registered while the program is initialized rather than checked on every
+// call. Sites of categories that aren't compiled in are never registered.
+template <typename Site, bool Compiled = TRACE_CATEGORY_COMPILED(Site::category()) != 0>
+struct TraceSiteRegistration {
+	static const uint16_t id;
+};
+
+template <typename Site, bool Compiled>
+const uint16_t TraceSiteRegistration<Site, Compiled>::id = TraceRegisterSite(Site::label(), Site::location(), Site::category());
+
+template <typename Site>
+struct TraceSiteRegistration<Site, false> {
+	static constexpr uint16_t id = TRACE_SITE_UNREGISTERED;
+};
+
+// TraceThreadGrow() records a block around itself.
+struct TraceGrowSite_t {
+	static constexpr trace_crcstr_t label() { return trace_crcstr_t("TraceThreadGrow()"); }
+	static constexpr trace_crcstr_t location() { return trace_crcstr_t(__FILE__ ":" TRACE_STRINGIZE(__LINE__)); }
+	static constexpr int category() { return 0; }
+};
+
+struct TraceBlock_t {
 	uint64_t start;
 	uint64_t end;
 	uint64_t childTime;
 	int parent;
+	uint32_t tag; // TraceInternTag() id, 0 for none
+	uint16_t site; // TraceRegisterSite() id
+	uint16_t skipped; // calls TraceSample() skipped before this one
 };
 
+// Tags are interned into a process wide table the first time they are seen
+// and blocks only carry the id (the tag's crc). Tags are copied so they can
+// be temporary buffers. Only TRACE_STATIC_TAG() literals are interned once
+// per call site, any other string (char arrays included) is looked up every
+// time. Once the table is full new tags all get TRACE_TAG_OVERFLOW.
+TRACE_API uint32_t TraceInternTag(trace_crcstr_t tag);
+
+#define TRACE_TAG_OVERFLOW_STRING "<tag table full>"
+#define TRACE_TAG_OVERFLOW (trace_crcstr_t(TRACE_TAG_OVERFLOW_STRING).crc)
+
+struct TraceStaticTag_t {
+	const char* str;
+};
+
+// _lit has to be a string literal, anything else fails to compile.
+#define TRACE_STATIC_TAG(_lit) (TraceStaticTag_t{ "" _lit })
+
+template <typename Site>
+inline uint32_t TraceTagID(std::nullptr_t) {
+	return 0;
+}
+
+template <typename Site>
+inline uint32_t TraceTagID(const TraceStaticTag_t& tag) {
+	static const uint32_t id = TraceInternTag(trace_crcstr_t(tag.str, trace_crc_runtime_tag));
+	return id;
+}
+
+template <typename Site, typename T>
+inline uint32_t TraceTagID(const T& tag) {
+	const char* str = tag;
+	return str ? TraceInternTag(trace_crcstr_t(str, trace_crc_runtime_tag)) : 0;
+}
+
+/*
+===============================================================================
+TRACE_COMPACT_EVENTS
+
+Define TRACE_COMPACT_EVENTS globally (for both TraceProfiler.cpp and any code
+that includes this header) to capture a stream of 16 byte begin/end events
+instead of TraceBlock_t's. A push appends one begin event with its site id
+and a pop appends one end event, neither touches any other record.
+The writer thread rebuilds parents, depth and child time from the event stream
+so the trace files are identical to the TraceBlock_t path.
+===============================================================================
+*/
+
+#ifdef TRACE_COMPACT_EVENTS
+enum {
+	TRACE_EVENT_END = 1,
+	TRACE_EVENT_TAG = 2,
+	TRACE_EVENT_COUNTER = 3 // with TRACE_EVENT_SITE(site, type), the next event's tsc is the value
+};
+
+#define TRACE_EVENT_SITE(_site, _skipped) (((uintptr_t)(_site) << 2) | ((uintptr_t)(_skipped) << 18))
+#define TRACE_EVENT_GET_SITE(_data) ((uint16_t)((_data) >> 2))
+#define TRACE_EVENT_GET_SKIPPED(_data) ((uint16_t)((_data) >> 18))
+
+struct TraceEvent_t {
+	uintptr_t data; // TRACE_EVENT_SITE() for a begin event, TRACE_EVENT_END or TRACE_EVENT_TAG
+	uint64_t tsc; // tag id for TRACE_EVENT_TAG, follows the begin event it belongs to
+};
+#endif
+
+/*
+===============================================================================
+TRACE_VIRTUAL_STORAGE
+
+Define TRACE_VIRTUAL_STORAGE globally to reserve one large range of address
+space per thread up front (TRACE_VIRTUAL_RESERVE, 64GB by default) and commit
+it as the thread fills it. Records are then a single flat array and
+TraceGetBlockNum() is a plain index instead of a walk back through the chunk
+list; prev/next/blockbase are unused.
+===============================================================================
+*/
+
+/*
+===============================================================================
+TRACE_FLIGHT_RECORDER
+
+Define TRACE_FLIGHT_RECORDER globally for bounded memory, always-on capture.
+Each thread keeps a ring of at most TraceSetFlightRecorder() chunks of
+TRACE_FLIGHT_BLOCK_SIZE blocks (subject to a global memory budget) and
+overwrites the oldest chunk when it runs out. Scopes that are still open when
+their chunk is recycled are moved to a small pinned table so pops and
+snapshots can still find them. Nothing is written to disk until
+TraceWriteSnapshot() or TraceTrigger() is called.
+===============================================================================
+*/
+
+/*
+===============================================================================
+TRACE_AGGREGATE
+
+Define TRACE_AGGREGATE globally for always-on production capture without a
+timeline. A pop adds its scope to per-thread totals for its site (calls,
+time, child time, shortest and longest call) instead of publishing a block,
+so a thread only ever keeps its open scopes. A reporter thread adds up every
+thread's totals each TRACE_AGGREGATE_INTERVAL ms and appends them as a
+checkpoint to "<path>.aggregate.trace", the viewer's stats tabs read it like
+any other trace file (it has no blocks). Elide thresholds don't apply.
+===============================================================================
+*/
+
+// Bookkeeping for a thread's chunk list, shared with its writer (the ring
+// in TRACE_FLIGHT_RECORDER builds). Chunks the writer is done with are freed
+// while the thread runs, blocks the writer still has to fix up are kept in a
+// small pinned table until it has.
+struct TraceRing_t;
+
+// parent of a block whose parent was recycled by the flight recorder
+#define TRACE_DROPPED_BLOCK -2
+// parent of a TRACE_COUNTER() sample, start is when it was taken, childTime
+// the value and skipped its TRACE_COUNTER_* type.
+#define TRACE_COUNTER_BLOCK -3
+
 struct TraceThread_t {
 	TraceThread_t* prev, *next;
 	char path[1024];
-	uint64_t micro_start;
-	uint64_t micro_end;
-	int numblocks;
+	uint64_t tsc_start;
+	uint64_t tsc_end;
+	int numblocks; // number of events in TRACE_COMPACT_EVENTS builds
 	int blockbase;
 	int maxblocks;
 	int stack;
 	uint32_t id;
-	FILE* fp;
 	int reset;
 	std::atomic_int writeblocks;
+	std::atomic<bool> ended; // set after the last writeblocks, the writers never read stack
+	int notifyblocks; // wake the writer pool once numblocks gets here
+	TraceRing_t* ring;
+#ifdef TRACE_COMPACT_EVENTS
+	TraceEvent_t _events[1];
+#else
 	TraceBlock_t _blocks[1];
+#endif
 };
 
 TRACE_API TraceThread_t* TraceThreadGrow();
@@ -477,28 +762,163 @@ TRACE_API void TraceThreadReset(int reset);
 TRACE_API void TraceWriteBlocks(int reset);
 TRACE_API void TraceShutdown();
 TRACE_API uint32_t TraceGetCurrentThreadID();
+// count writer threads (TRACE_WRITER_THREADS by default) write the trace
+// files of all threads. affinityMask (0 for any core) and priority (0 to
+// leave it alone, a SetThreadPriority() value on Windows and a nice value
+// elsewhere) keep them off latency critical cores. Call before the first
+// TRTHREADPROC(), only the affinity and priority apply to the flight
+// recorder's trigger thread and the aggregate reporter.
+TRACE_API void TraceSetWriterThreads(int count, uint64_t affinityMask, int priority);
+#if !defined(TRACE_FLIGHT_RECORDER) && !defined(TRACE_AGGREGATE)
+TRACE_API void TraceWakeWriter(TraceThread_t* thread);
+// CPU time used by the writer threads that have exited, TraceShutdown() waits
+// for all of them.
+TRACE_API double TraceGetWriterCpuSeconds();
+#endif
+
+// How the writer gets trace files to disk. Every backend stages records in
+// large aligned buffers, TraceSetOutput() picks the backend for the files
+// opened after it. A backend that isn't available for a file (O_DIRECT on a
+// file system that doesn't support it for instance) falls back to stdio.
+enum {
+	TRACE_OUTPUT_STDIO, // buffered stdio, the default
+	TRACE_OUTPUT_DIRECT, // unbuffered O_DIRECT / FILE_FLAG_NO_BUFFERING writes
+	TRACE_OUTPUT_MMAP, // a memory mapped file that grows as it is written
+};
+TRACE_API void TraceSetOutput(int output);
 
+#ifdef TRACE_FLIGHT_RECORDER
+#if defined(TRACE_COMPACT_EVENTS) || defined(TRACE_VIRTUAL_STORAGE)
+#error "TRACE_FLIGHT_RECORDER can't be combined with TRACE_COMPACT_EVENTS or TRACE_VIRTUAL_STORAGE"
+#endif
+// chunksPerThread is the ring size of each thread, budgetBytes caps the
+// memory used by all rings together (every thread may always keep 2 chunks).
+TRACE_API void TraceSetFlightRecorder(int chunksPerThread, uint64_t budgetBytes);
+// Writes the blocks currently held by each thread's ring to
+// "<path>.<thread name>.<thread id>.trace". A null path uses the TraceInit()
+// path with a snapshot number appended.
+TRACE_API void TraceWriteSnapshot(const char* path);
+// Snapshots every thread in the background once postRollMillis have passed
+// since the trigger, keeping the preRollMillis before it. The rings grow
+// (within the memory budget) instead of recycling until then. Triggers that
+// fire while one is pending are merged into it.
+TRACE_API void TraceSetTrigger(uint32_t preRollMillis, uint32_t postRollMillis);
+TRACE_API void TraceTrigger(const char* reason);
+#endif
+
+#if defined(TRACE_AGGREGATE) && (defined(TRACE_FLIGHT_RECORDER) || defined(TRACE_COMPACT_EVENTS) || defined(TRACE_VIRTUAL_STORAGE))
+#error "TRACE_AGGREGATE can't be combined with TRACE_FLIGHT_RECORDER, TRACE_COMPACT_EVENTS or TRACE_VIRTUAL_STORAGE"
+#endif
+
+#if !defined(TRACE_COMPACT_EVENTS) && !defined(TRACE_VIRTUAL_STORAGE)
+TRACE_API TraceBlock_t* TraceGetPinnedBlock(TraceThread_t* thread, int blocknum);
+#endif
+
+// Every pop publishes the records written so far to the writer threads and
+// wakes them every TRACE_WRITER_BATCH records. The publish is a release
+// store and a compare. Open blocks are written as they are and fixed up once
+// they close. Define TRACE_MANUAL_COMMIT to only publish from
+// TRACE_WRITEBLOCKS() instead.
+// Flight recorder snapshots copy the blocks published by every push and pop,
+// aggregate builds never publish anything.
+#if defined(TRACE_FLIGHT_RECORDER)
+#define __TRACECOMMIT(_thread) (_thread)->writeblocks.store((_thread)->numblocks, std::memory_order_release)
+#define __TRACEPUSHCOMMIT(_thread) __TRACECOMMIT(_thread)
+#elif defined(TRACE_MANUAL_COMMIT) || defined(TRACE_AGGREGATE)
+#define __TRACECOMMIT(_thread) ((void)0)
+#define __TRACEPUSHCOMMIT(_thread) ((void)0)
+#else
+#define __TRACECOMMIT(_thread) do {\
+	(_thread)->writeblocks.store((_thread)->numblocks, std::memory_order_release);\
+	if ((_thread)->numblocks >= (_thread)->notifyblocks) {\
+		TraceWakeWriter(_thread);\
+	}\
+} while (0)
+#define __TRACEPUSHCOMMIT(_thread) ((void)0)
+#endif
+
+#ifdef TRACE_COMPACT_EVENTS
+inline TraceEvent_t* TraceGetEventNum(TraceThread_t* thread, int eventnum) {
+#ifdef TRACE_VIRTUAL_STORAGE
+	return &thread->_events[eventnum];
+#else
+	while (eventnum < thread->blockbase) {
+		thread = thread->prev;
+	}
+	return &thread->_events[eventnum - thread->blockbase];
+#endif
+}
+
+// TraceThreadGrow() records its own begin/end events in compact builds.
+
+#define __TRACEPUSHFN(_linkage, _name) \
+_linkage void _name(uint16_t site, uint32_t tag, uint16_t skipped) { \
+	auto thread = __tr_thread; \
+	auto index = thread->numblocks; \
+	if (index + 2 > thread->maxblocks) {\
+		thread = TraceThreadGrow();\
+		index = thread->numblocks;\
+	}\
+	auto event = TraceGetEventNum(thread, index);\
+	if (tag) {\
+		auto tagEvent = TraceGetEventNum(thread, index + 1);\
+		tagEvent->data = TRACE_EVENT_TAG;\
+		tagEvent->tsc = tag;\
+		thread->numblocks = index + 2;\
+	} else {\
+		thread->numblocks = index + 1;\
+	}\
+	event->data = TRACE_EVENT_SITE(site, skipped);\
+	event->tsc = TRACE_RDTSC();\
+}
+
+#define __TRACEPOPFN(_linkage, _name) \
+_linkage void _name() {\
+	auto end = TRACE_RDTSC();\
+	auto thread = __tr_thread;\
+	auto index = thread->numblocks;\
+	if (index + 1 > thread->maxblocks) {\
+		thread = TraceThreadGrow();\
+		index = thread->numblocks;\
+		end = TRACE_RDTSC();\
+	}\
+	auto event = TraceGetEventNum(thread, index);\
+	event->data = TRACE_EVENT_END;\
+	event->tsc = end;\
+	thread->numblocks = index + 1;\
+	__TRACECOMMIT(thread);\
+}
+
+TRACE_API void __TracePush(uint16_t site, uint32_t tag, uint16_t skipped);
+#else
 inline TraceBlock_t* TraceGetBlockNum(TraceThread_t* thread, int blocknum) {
+#ifdef TRACE_VIRTUAL_STORAGE
+	return &thread->_blocks[blocknum];
+#else
+	const auto newest = thread;
 	while (blocknum < thread->blockbase) {
 		thread = thread->prev;
+		if (!thread) {
+			return TraceGetPinnedBlock(newest, blocknum);
+		}
 	}
 	return &thread->_blocks[blocknum - thread->blockbase];
+#endif
 }
 
 #define __TRACEPUSHFN(_linkage, _name) \
-_linkage void _name(trace_crcstr_t label, trace_crcstr_t location, const char* tag) { \
+_linkage void _name(uint16_t site, uint32_t tag, uint16_t skipped) { \
 	auto thread = __tr_thread; \
 	auto index = thread->numblocks; \
 	if (index + 1 >= thread->maxblocks) {\
-		static constexpr trace_crcstr_t crclabel("TraceThreadGrow()");\
-		static constexpr trace_crcstr_t crclocation( __FILE__ ":" TRACE_STRINGIZE(__LINE__));\
 		auto start = TRACE_RDTSC();\
 		thread = TraceThreadGrow();\
 		auto end = TRACE_RDTSC();\
+		index = thread->numblocks;\
 		auto block = TraceGetBlockNum(thread, index);\
-		block->label = crclabel;\
-		block->location = crclocation;\
-		block->tag = nullptr;\
+		block->site = TraceSiteRegistration<TraceGrowSite_t>::id;\
+		block->skipped = 0;\
+		block->tag = 0;\
 		block->parent = thread->stack;\
 		block->childTime = 0;\
 		block->start = start;\
@@ -511,33 +931,84 @@ _linkage void _name(trace_crcstr_t label, trace_crcstr_t location, const char* t
 	}\
 	thread->numblocks = index + 1;\
 	auto block = TraceGetBlockNum(thread, index);\
-	block->label = label;\
-	block->location = location;\
+	block->site = site;\
+	block->skipped = skipped;\
 	block->tag = tag;\
 	block->parent = thread->stack;\
 	thread->stack = index;\
 	block->end = 0;\
 	block->childTime = 0;\
 	block->start = TRACE_RDTSC();\
+	__TRACEPUSHCOMMIT(thread);\
 }
 
+// A leaf block that closes faster than its site's TraceSetElideThreshold()
+// is taken back by the pop and only counted, unless it was published while
+// open (TRACE_WRITEBLOCKS() inside it, or any commit with
+// TRACE_MANUAL_COMMIT) and a writer may already have read it. Only this
+// thread stores writeblocks. The flight recorder publishes on push and
+// never elides.
+#ifdef TRACE_FLIGHT_RECORDER
+#define __TRACEELIDE(_thread, _block, _ticks) false
+#else
+#define __TRACEELIDE(_thread, _block, _ticks) (((_thread)->stack == ((_thread)->numblocks - 1)) && ((_thread)->stack >= (_thread)->writeblocks.load(std::memory_order_relaxed)) && ((_ticks) < __tr_siteElideTicks[(_block)->site].load(std::memory_order_relaxed)))
+#endif
+
+#ifdef TRACE_AGGREGATE
+// every scope is a leaf by the time it pops, it goes into the totals and its
+// block is taken back for the next push.
+#define __TRACEPOPFN(_linkage, _name) \
+_linkage void _name() {\
+	auto thread = __tr_thread;\
+	TRACE_ASSERT(thread->stack >= 0);\
+	TRACE_ASSERT(thread->stack < thread->numblocks);\
+	auto block = TraceGetBlockNum(thread, thread->stack);\
+	const auto ticks = TRACE_RDTSC() - block->start;\
+	const auto parentidx = block->parent;\
+	TraceAggregate(thread, block, ticks);\
+	thread->numblocks = thread->stack;\
+	thread->stack = parentidx;\
+	if (parentidx >= 0) {\
+		auto parent = TraceGetBlockNum(thread, parentidx);\
+		parent->childTime += ticks;\
+	}\
+}
+#else
 #define __TRACEPOPFN(_linkage, _name) \
 _linkage void _name() {\
 	auto thread = __tr_thread;\
 	TRACE_ASSERT(thread->stack >= 0);\
 	TRACE_ASSERT(thread->stack < thread->numblocks);\
 	auto block = TraceGetBlockNum(thread, thread->stack);\
-	block->end = TRACE_RDTSC();\
+	const auto end = TRACE_RDTSC();\
+	const auto start = block->start;\
 	const auto parentidx = block->parent;\
+	if (__TRACEELIDE(thread, block, end-start)) {\
+		thread->numblocks = thread->stack;\
+		TraceElide(thread, block->site, block->skipped, end-start);\
+	} else {\
+		/* the writer may be done with the block once end is stored */\
+		TRACE_STORE_RELEASE(&block->end, end);\
+	}\
 	thread->stack = parentidx;\
 	if (parentidx >= 0) {\
 		auto parent = TraceGetBlockNum(thread, parentidx);\
-		parent->childTime += (block->end-block->start);\
+		parent->childTime += (end-start);\
 	}\
+	__TRACECOMMIT(thread);\
 }
+#endif
+
+TRACE_API void __TracePush(uint16_t site, uint32_t tag, uint16_t skipped);
+#endif
 
-TRACE_API void __TracePush(trace_crcstr_t label, trace_crcstr_t location, const char* tag);
 TRACE_API void __TracePop();
+#ifndef TRACE_COMPACT_EVENTS
+TRACE_API void TraceElide(TraceThread_t* thread, uint16_t site, uint16_t skipped, uint64_t ticks);
+#endif
+#ifdef TRACE_AGGREGATE
+TRACE_API void TraceAggregate(TraceThread_t* thread, const TraceBlock_t* block, uint64_t ticks);
+#endif
 
 extern THREAD_LOCAL TraceThread_t* __tr_thread;
 
@@ -553,6 +1024,7 @@ __TRACEPOPFN(inline, __TracePopInline)
 
 struct __TR_BLOCKS : TraceNotCopyable {
 	int count;
+	bool label; // the last TRLABEL() pushed and is still open
 
 	~__TR_BLOCKS() {
 		while (--count >= 0) {
@@ -561,15 +1033,19 @@ struct __TR_BLOCKS : TraceNotCopyable {
 	}
 };
 
+// constructed before its push, a switched off site leaves count alone.
 struct __TR_BLOCKPOP : TraceNotCopyable {
-	__TR_BLOCKPOP(__TR_BLOCKS* blocks) : _blocks(blocks) {}
+	__TR_BLOCKPOP(__TR_BLOCKS* blocks) : _blocks(blocks), _count(blocks->count) {}
 	~__TR_BLOCKPOP() {
-		--_blocks->count;
-		__TRACEPOPFNNAME();
+		if (_blocks->count > _count) {
+			--_blocks->count;
+			__TRACEPOPFNNAME();
+		}
 	}
 
 private:
 	__TR_BLOCKS* _blocks;
+	int _count;
 };
 
 struct __TR_THREADPOP : TraceNotCopyable {
@@ -578,42 +1054,123 @@ struct __TR_THREADPOP : TraceNotCopyable {
 	}
 };
 
-#define __TRPUSH(_label, _location, _tag) \
-	{ ++__tr_blocks.count;\
+#define __TRPUSH(_cat, _label, _location, _tag) \
+	{ static_assert(((_cat) >= 0) && ((_cat) < TRACE_MAX_CATEGORIES), "trace categories are 0 to TRACE_MAX_CATEGORIES - 1");\
 		static constexpr trace_crcstr_t crclabel(_label);\
 		static constexpr trace_crcstr_t crclocation(_location);\
-		__TRACEPUSHFNNAME(crclabel, crclocation, _tag); \
+		struct site_t {\
+			static constexpr trace_crcstr_t label() { return crclabel; }\
+			static constexpr trace_crcstr_t location() { return crclocation; }\
+			static constexpr int category() { return (_cat); }\
+		};\
+		const auto site = TraceSiteRegistration<site_t>::id;\
+		const auto skipped = TRACE_CATEGORY_COMPILED(_cat) ? TraceSiteSample(site) : -1;\
+		if (skipped >= 0) {\
+			++__tr_blocks.count;\
+			__TRACEPUSHFNNAME(site, TraceTagID<site_t>(_tag), (uint16_t)skipped);\
+		}\
 	} ((void)0)
 
-#define __TRLABEL(_label, _location, _tag) \
-	if (__tr_blocks.count > 1) {--__tr_blocks.count; __TRACEPOPFNNAME(); }\
-	__TRPUSH(_label, _location, _tag)
+#define __TRLABEL(_cat, _label, _location, _tag) \
+	if (__tr_blocks.label) { __tr_blocks.label = false; --__tr_blocks.count; __TRACEPOPFNNAME(); }\
+	{ const auto count = __tr_blocks.count;\
+		__TRPUSH(_cat, _label, _location, _tag);\
+		__tr_blocks.label = (__tr_blocks.count != count);\
+	} ((void)0)
 
-#define TRLABEL(_label) __TRLABEL(_label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
-#define TRLABEL_TAG(_label, _tag) __TRLABEL(_label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
+#define TRLABEL(_label) __TRLABEL(0, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRLABEL_TAG(_label, _tag) __TRLABEL(0, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
+#define TRLABEL_CAT(_cat, _label) __TRLABEL(_cat, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRLABEL_CAT_TAG(_cat, _label, _tag) __TRLABEL(_cat, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
 
-#define __TRBLOCK(_label, _location, _tag) \
-	__TRPUSH(_label, _location, _tag); \
-	__TR_BLOCKPOP __tr_block_pop_##__COUNTER__(&__tr_blocks)
+#define __TRBLOCK(_cat, _label, _location, _tag) \
+	__TR_BLOCKPOP __tr_block_pop_##__COUNTER__(&__tr_blocks); \
+	__TRPUSH(_cat, _label, _location, _tag)
 
-#define TRBLOCK(_label) __TRBLOCK(_label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
-#define TRBLOCK_TAG(_label, _tag) __TRBLOCK(_label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
+#define TRBLOCK(_label) __TRBLOCK(0, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRBLOCK_TAG(_label, _tag) __TRBLOCK(0, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
+#define TRBLOCK_CAT(_cat, _label) __TRBLOCK(_cat, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRBLOCK_CAT_TAG(_cat, _label, _tag) __TRBLOCK(_cat, _label, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
 
-#define __TRACE(_label, _location, _tag) \
+#define __TRACE(_cat, _label, _location, _tag) \
 	__TR_BLOCKS __tr_blocks;\
 	__tr_blocks.count = 0;\
-	__TRPUSH(_label, _location, _tag)
+	__tr_blocks.label = false;\
+	__TRPUSH(_cat, _label, _location, _tag)
 
-#define TRACE() __TRACE(__FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
-#define TRACE_TAG(_tag) __TRACE(__FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
-
-#define TRACE_WRITEBLOCKS(_reset) TraceWriteBlocks(_reset)
+#define TRACE() __TRACE(0, __FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRACE_TAG(_tag) __TRACE(0, __FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
+#define TRACE_CAT(_cat) __TRACE(_cat, __FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), nullptr)
+#define TRACE_CAT_TAG(_cat, _tag) __TRACE(_cat, __FUNCTION__, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _tag)
 
 #define TRTHREADPROC(_name) \
 	__TR_THREADPOP __tr_pop; \
 	TraceBeginThread(_name, TraceGetCurrentThreadID())
 
+/*
+===============================================================================
+Counters
+
+TRACE_COUNTER(name, value) records a sample of a number (entity counts, queue
+depths, bytes allocated) with the time it was taken, one record in the
+thread's buffer next to its blocks. The name has to be a string literal, it
+registers a site like TRACE() does so counters can be switched off and put in
+categories the same way. Integers are kept as int64_t and floating point
+values as doubles, by the type of value. The viewer draws every counter as a
+line graph under its thread's blocks. TRACE_AGGREGATE builds have no timeline
+and don't record counters, value isn't evaluated.
+===============================================================================
+*/
+
+enum {
+	TRACE_COUNTER_INT64 = 0,
+	TRACE_COUNTER_DOUBLE = 1
+};
+
+#ifdef TRACE_AGGREGATE
+#define __TRCOUNTER(_cat, _name, _location, _value) ((void)0)
+#else
+TRACE_API void TraceCounterInt64(uint16_t site, int64_t value);
+TRACE_API void TraceCounterDouble(uint16_t site, double value);
+
+template <typename T>
+inline void TraceCounter(uint16_t site, T value) {
+	static_assert(std::is_arithmetic<T>::value, "TRACE_COUNTER() values are integers or floating point");
+	if (std::is_floating_point<T>::value) {
+		TraceCounterDouble(site, (double)value);
+	} else {
+		TraceCounterInt64(site, (int64_t)value);
+	}
+}
+
+#define __TRCOUNTER(_cat, _name, _location, _value) \
+	{ static_assert(((_cat) >= 0) && ((_cat) < TRACE_MAX_CATEGORIES), "trace categories are 0 to TRACE_MAX_CATEGORIES - 1");\
+		static constexpr trace_crcstr_t crclabel(_name);\
+		static constexpr trace_crcstr_t crclocation(_location);\
+		struct site_t {\
+			static constexpr trace_crcstr_t label() { return crclabel; }\
+			static constexpr trace_crcstr_t location() { return crclocation; }\
+			static constexpr int category() { return (_cat); }\
+		};\
+		const auto site = TraceSiteRegistration<site_t>::id;\
+		if (TRACE_CATEGORY_COMPILED(_cat) && TraceSiteEnabled(site)) {\
+			TraceCounter(site, (_value));\
+		}\
+	} ((void)0)
+#endif
+
+#define TRACE_COUNTER(_name, _value) __TRCOUNTER(0, _name, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _value)
+#define TRACE_COUNTER_CAT(_cat, _name, _value) __TRCOUNTER(_cat, _name, __FILE__ ":" TRACE_STRINGIZE(__LINE__), _value)
+
+// without TRACE_MANUAL_COMMIT pops publish on their own, this only flushes
+// them to the writers early. Published records can't be taken back so
+// resets do nothing unless TRACE_MANUAL_COMMIT or the flight recorder.
+#define TRACE_WRITEBLOCKS(_reset) TraceWriteBlocks(_reset)
+#if defined(TRACE_MANUAL_COMMIT) || defined(TRACE_FLIGHT_RECORDER)
 #define TRTHREAD_RESET(_reset) TraceThreadReset(_reset) 
+#else
+#define TRTHREAD_RESET(_reset) ((void)(_reset))
+#endif
 
 #ifdef __TRACE_DEFINED_ASSERT
 #undef __TRACE_DEFINED_ASSERT
@@ -628,7 +1185,15 @@ struct __TR_THREADPOP : TraceNotCopyable {
 #define TRBLOCK_TAG(_label, _tag) ((void)0)
 #define TRLABEL_TAG(_label, _tag) ((void)0)
 #define TRACE_TAG(_tag) ((void)0)
+#define TRBLOCK_CAT(_cat, _label) ((void)0)
+#define TRLABEL_CAT(_cat, _label) ((void)0)
+#define TRACE_CAT(_cat) ((void)0)
+#define TRBLOCK_CAT_TAG(_cat, _label, _tag) ((void)0)
+#define TRLABEL_CAT_TAG(_cat, _label, _tag) ((void)0)
+#define TRACE_CAT_TAG(_cat, _tag) ((void)0)
 #define TRTHREADPROC(_label) ((void)0)
+#define TRACE_COUNTER(_name, _value) ((void)0)
+#define TRACE_COUNTER_CAT(_cat, _name, _value) ((void)0)
 #define TRACE_WRITEBLOCKS(_reset) ((void)0)
 #define TRTHREAD_RESET(_reset) ((void)0)
 
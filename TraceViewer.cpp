@@ -21,7 +21,10 @@
 #include <array>
 #include <algorithm>
 #include <assert.h>
+#include <stddef.h>
+#include <float.h>
 #include <memory>
+#include <unordered_map>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -53,32 +56,55 @@ enum ESetSelectedTab {
 
 static ESetSelectedTab s_setSelectedTab;
 
-static const std::array<uint64_t, 24> TIMESCALES = {
-	10, // 10 microseconds
-	25, // 25 microseconds
-	50, // 50 microseconds
-	100, // 100 microseconds
-	250, // 256 microseconds
-	500, // 500 microseconds
-	1000, // one millisecond
-	2000, // two milliseconds
-	4000, // four milliseconds
-	8000, // eight milliseconds
-	16000, // sixteen milliseconds
-	32000, // 32 milliseconds
-	64000, // 64 milliseconds
-	128000, // 128 milliseconds
-	256000, // 256 milliseconds
-	500000, // 500 milliseconds
-	1000*1000, // 1 second
-	2 * 1000 * 1000, // 2 seconds
-	4 * 1000 * 1000, // 4 seconds
-	8 * 1000 * 1000, // 8 seconds
-	16 * 1000 * 1000, // 16 seconds
-	30 * 1000 * 1000, // 30 seconds
-	60 * 1000 * 1000, // 60 seconds
+// category tag ids unchecked in the category filter, their blocks aren't drawn or listed.
+static std::vector<uint32_t> s_hiddenCategories;
+
+// a file's calling context tree changed, the merged one needs to be redone.
+static bool s_mergeContexts;
+
+// how often files that are still being written are checked for new checkpoints.
+static const uint32_t REFRESH_INTERVAL_IN_MS = 500;
+// packed block segments (64K blocks each) a file keeps decoded.
+static const int MAX_DECODED_SEGMENTS = 32;
+
+// the viewer works in nanoseconds.
+static const std::array<uint64_t, 31> TIMESCALES = {
+	50, // 50 nanoseconds
+	100, // 100 nanoseconds
+	250, // 250 nanoseconds
+	500, // 500 nanoseconds
+	1000, // one microsecond
+	2500, // 2.5 microseconds
+	5000, // 5 microseconds
+	10 * 1000, // 10 microseconds
+	25 * 1000, // 25 microseconds
+	50 * 1000, // 50 microseconds
+	100 * 1000, // 100 microseconds
+	250 * 1000, // 256 microseconds
+	500 * 1000, // 500 microseconds
+	1000 * 1000, // one millisecond
+	2000 * 1000, // two milliseconds
+	4000 * 1000, // four milliseconds
+	8000 * 1000, // eight milliseconds
+	16000 * 1000, // sixteen milliseconds
+	32000 * 1000, // 32 milliseconds
+	64000 * 1000, // 64 milliseconds
+	128000 * 1000, // 128 milliseconds
+	256000 * 1000, // 256 milliseconds
+	500000 * 1000, // 500 milliseconds
+	1000 * 1000 * 1000, // 1 second
+	2 * 1000 * 1000 * 1000ull, // 2 seconds
+	4 * 1000 * 1000 * 1000ull, // 4 seconds
+	8 * 1000 * 1000 * 1000ull, // 8 seconds
+	16 * 1000 * 1000 * 1000ull, // 16 seconds
+	30 * 1000 * 1000 * 1000ull, // 30 seconds
+	60 * 1000 * 1000 * 1000ull, // 60 seconds
 };
 
+// TIMESCALES index of 250 microseconds and 16 milliseconds.
+static const int TIMESCALE_CALL = 11;
+static const int TIMESCALE_DEFAULT = 17;
+
 static void SetTimeScale(int index, uint64_t fixedTime) {
 	double dtw;
 
@@ -146,16 +172,32 @@ static void TimescaleDown(uint64_t fixedTime) {
 	}
 }
 
+// see TraceLatency_t in TraceProfiler.cpp.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define SLOWEST_CALLS 16
+
+// p50, p90, p99 and p99.9 in 1/1000ths.
+static const uint64_t PERCENTILES[] = { 500, 900, 990, 999 };
+#define NUM_PERCENTILES 4
+
 struct StackFrame_t {
 	char label[256];
 	char location[256];
 	uint64_t wallTime;
 	uint64_t childTime;
-	uint64_t callCount;
+	uint64_t callCount; // elided and skipped calls included
 	uint64_t bestCallTime;
 	uint64_t worstCallTime;
-	int bestcall;
+	int bestcall; // -1 if every call was elided
 	int worstcall;
+	uint32_t category; // tag id of the category name, 0 for none
+	uint64_t elidedCalls;
+	uint64_t skippedCalls; // not recorded by sampling, their time is estimated
+	uint64_t percentiles[NUM_PERCENTILES]; // of the recorded calls, version 8
+	int numslowest;
+	int slowest[SLOWEST_CALLS]; // blocks of the slowest recorded calls, slowest first
+	uint64_t slowestTime[SLOWEST_CALLS];
 };
 
 struct Tag_t {
@@ -177,6 +219,204 @@ struct IndexBlock_t {
 	int indices[1];
 };
 
+struct header_t {
+	uint32_t magic;
+	uint32_t version;
+	int numstacks;
+	int numtags;
+	int numblocks;
+	int numindexblocks;
+	int maxparents;
+	int padd;
+	uint64_t stackofs;
+	uint64_t tagofs;
+	uint64_t indexofs;
+	uint64_t micro_start;
+	uint64_t micro_end;
+	uint64_t timebase;
+};
+
+// Version 3 to 10 files are a header_t followed by segments that are only
+// ever appended, see TraceProfiler.cpp. Everything up to the last complete
+// checkpoint can be read while the file is still being written. Version 4
+// packs blocks and index entries as varints. Version 5 times are ticks that
+// the sync points in the checkpoints convert to nanoseconds, older files are
+// in microseconds. Version 7 stack stats count the calls that sampling
+// skipped. Version 8 checkpoints add a call time histogram and the slowest
+// calls of each stack frame whose stats changed. Version 9 adds the calling
+// context tree in segments before the checkpoints, version 10 counters.
+#define SEGMENT_BLOCKS FOURCC('B', 'L', 'K', 'S')
+#define SEGMENT_PACKED_BLOCKS FOURCC('B', 'L', 'K', 'P')
+#define SEGMENT_CHECKPOINT FOURCC('C', 'H', 'K', 'P')
+#define SEGMENT_CONTEXTS FOURCC('C', 'T', 'X', 'P')
+#define SEGMENT_COUNTERS FOURCC('C', 'N', 'T', 'P')
+#define SEGMENT_CHECKPOINT_END FOURCC('C', 'E', 'N', 'D')
+
+struct segment_t {
+	uint32_t magic;
+	uint32_t size;
+};
+
+struct contextsegment_t {
+	int firstnode;
+	int numnodes;
+	int numchanged;
+	uint32_t bytes;
+};
+
+struct countersegment_t {
+	int numcounters;
+	int numsamples;
+	uint32_t bytes;
+	int padd;
+	uint64_t tick_start;
+	uint64_t tick_end;
+};
+
+#define COUNTER_INT64 0
+#define COUNTER_DOUBLE 1
+
+struct counterdef_t {
+	uint32_t id;
+	uint32_t category;
+	uint32_t type;
+	int padd;
+	char label[256];
+	char location[256];
+};
+
+struct blocksegment_t {
+	int firstblock;
+	int numblocks;
+};
+
+struct packedsegment_t {
+	int firstblock;
+	int numblocks;
+	uint32_t bytes;
+	int padd;
+};
+
+struct checkpoint_t {
+	int numblocks;
+	int maxparents;
+	int numstacks;
+	int numstackstats;
+	int numtags;
+	int numpatches;
+	int numopen;
+	int numindices;
+	uint64_t micro_start; // ticks in version 5
+	uint64_t micro_end;
+	int final;
+	uint32_t indexbytes; // version 4
+	int numsyncs; // version 5
+	uint32_t latencybytes; // version 8
+};
+
+struct syncpoint_t {
+	uint64_t tick;
+	uint64_t nanos;
+};
+
+struct stackdef_t {
+	uint32_t id;
+	uint32_t category; // tagdef_t id of the category name, 0 for none
+	char label[256];
+	char location[256];
+};
+
+struct stackstats_t {
+	uint32_t id;
+	int bestcall;
+	int worstcall;
+	int padd;
+	uint64_t wallTime;
+	uint64_t childTime;
+	uint64_t callCount;
+	uint64_t bestCallTime;
+	uint64_t worstCallTime;
+	uint64_t elidedCalls; // version 6
+	uint64_t sampledCalls; // version 7
+	uint64_t sampledTime;
+	uint64_t skippedCalls;
+};
+
+// version 2 stack frames.
+struct stackframe_t {
+	char label[256];
+	char location[256];
+	uint64_t wallTime;
+	uint64_t childTime;
+	uint64_t callCount;
+	uint64_t bestCallTime;
+	uint64_t worstCallTime;
+	int bestcall;
+	int worstcall;
+};
+
+struct tagdef_t {
+	uint32_t id;
+	int padd;
+	char string[256];
+};
+
+struct patch_t {
+	int blocknum;
+	int padd;
+	TimingRecord_t block;
+};
+
+struct indexentry_t {
+	int index;
+	int blocknum;
+};
+
+struct checkpointend_t {
+	uint32_t magic;
+	int numblocks;
+};
+
+struct BlockSegment_t {
+	int firstblock;
+	int numblocks;
+	uint64_t ofs; // of the first block in the file
+	uint32_t bytes; // packed, 0 for TimingRecord_t[numblocks]
+	// packed segments are decoded the first time one of their blocks is
+	// needed and dropped again once they haven't been drawn for a while.
+	mutable std::vector<TimingRecord_t> decoded;
+	mutable int used;
+};
+
+// a calling context tree node, the stack frame called through the path of
+// its parents.
+struct Context_t {
+	int parent; // -1 for a root
+	uint32_t stackframe;
+	uint64_t callCount; // recorded calls
+	uint64_t wallTime;
+	uint64_t childTime;
+};
+
+struct CounterRange_t {
+	double min;
+	double max;
+};
+
+// samples in file ticks, they convert with the sync points at draw time.
+// levels[0] is the range of each COUNTER_GROUP samples, every level after
+// that of COUNTER_GROUP entries of the one before.
+struct Counter_t {
+	uint32_t id;
+	uint32_t category;
+	uint32_t type;
+	char label[256];
+	char location[256];
+	std::vector<uint64_t> ticks;
+	std::vector<double> values;
+	std::vector<std::vector<CounterRange_t>> levels;
+};
+
 struct Span_t {
 	uint64_t start;
 	uint64_t end;
@@ -202,14 +442,15 @@ struct TraceFile_t {
 	char path[1024];
 	mio::mmap_source mmap;
 
+	int version;
 	int numstacks;
 	int numtags;
 	int numblocks;
 	int numindexblocks;
 	int maxparents;
-	uint64_t micro_start;
-	uint64_t micro_end;
-	uint64_t timebase;
+	uint64_t nano_start;
+	uint64_t nano_end;
+	uint64_t timebase; // index bucket size in the file's time unit
 
 	const uint32_t* stackFrameIDs;
 	const uint32_t* tagIDs;
@@ -223,12 +464,240 @@ struct TraceFile_t {
 	std::vector<int> stacksByBest;
 	std::vector<int> stacksByWorst;
 	std::vector<int> stacksBySelf;
+	std::vector<int> stacksByTail;
+
+	// version 3 and 4, everything up to the last checkpoint read so far.
+	uint64_t parsed; // where the next segment starts
+	bool final; // the last checkpoint has been read, the file won't change
+	std::vector<BlockSegment_t> segments;
+	mutable int numdecoded; // packed segments decoded right now
+	int generation; // GenerateSpans() calls so far
+	std::unordered_map<int, TimingRecord_t> patched; // blocks rewritten once they closed
+	std::vector<int> open; // blocks that haven't closed yet
+	std::vector<uint32_t> stackFrameIDData;
+	std::vector<StackFrame_t> stackFrameData;
+	std::vector<uint32_t> tagIDData;
+	std::vector<Tag_t> tagData;
+	std::vector<uint32_t> stackFrameOrder; // ids in the order they were defined
+	std::vector<uint32_t> tagOrder;
+	std::vector<syncpoint_t> syncs;
+	double nanosPerTick; // over all of syncs, for durations
+	std::vector<std::vector<int>> index;
+	std::vector<Context_t> contexts; // version 9
+	std::vector<Counter_t> counters; // version 10
 
 	bool collapsed;
 };
 
 std::vector<std::unique_ptr<TraceFile_t>> s_files;
 
+static inline uint64_t ReadVarint(const uint8_t*& p) {
+	uint64_t value = 0;
+	for (int shift = 0;; shift += 7) {
+		const auto b = *p++;
+		value |= (uint64_t)(b & 0x7f) << shift;
+		if (b < 0x80) {
+			return value;
+		}
+	}
+}
+
+static inline int64_t UnZigZag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// a file time (ticks or microseconds) to nanoseconds.
+static uint64_t ToNanos(const TraceFile_t& trace, uint64_t time) {
+	if (trace.version < 5) {
+		return time * 1000;
+	}
+
+	const auto& syncs = trace.syncs;
+	if (syncs.size() < 2) {
+		return (uint64_t)(time * trace.nanosPerTick);
+	}
+
+	// the sync points on either side, or the closest two at the ends.
+	const auto it = std::upper_bound(syncs.begin(), syncs.end(), time, [](uint64_t t, const syncpoint_t& sync) { return t < sync.tick; });
+	const auto i = std::min<size_t>((it == syncs.begin()) ? 0 : (it - syncs.begin()) - 1, syncs.size() - 2);
+	const auto& a = syncs[i];
+	const auto& b = syncs[i + 1];
+	const auto rate = (b.tick > a.tick) ? (b.nanos - a.nanos) / (double)(b.tick - a.tick) : trace.nanosPerTick;
+	const auto nanos = a.nanos + ((double)time - (double)a.tick) * rate;
+	return (nanos > 0) ? (uint64_t)nanos : 0;
+}
+
+static uint64_t DurationToNanos(const TraceFile_t& trace, uint64_t duration) {
+	return (trace.version < 5) ? duration * 1000 : (uint64_t)(duration * trace.nanosPerTick);
+}
+
+// the other way, for looking up index buckets.
+static uint64_t FromNanos(const TraceFile_t& trace, uint64_t nanos) {
+	if (trace.version < 5) {
+		return nanos / 1000;
+	}
+
+	const auto& syncs = trace.syncs;
+	if (syncs.size() < 2) {
+		return (uint64_t)(nanos / trace.nanosPerTick);
+	}
+
+	const auto it = std::upper_bound(syncs.begin(), syncs.end(), nanos, [](uint64_t n, const syncpoint_t& sync) { return n < sync.nanos; });
+	const auto i = std::min<size_t>((it == syncs.begin()) ? 0 : (it - syncs.begin()) - 1, syncs.size() - 2);
+	const auto& a = syncs[i];
+	const auto& b = syncs[i + 1];
+	const auto rate = (b.nanos > a.nanos) ? (b.tick - a.tick) / (double)(b.nanos - a.nanos) : 1 / trace.nanosPerTick;
+	const auto tick = a.tick + ((double)nanos - (double)a.nanos) * rate;
+	return (tick > 0) ? (uint64_t)tick : 0;
+}
+
+// the middle of a histogram bucket in ticks, see TraceLatencyBucket().
+static uint64_t LatencyBucketTicks(int bucket) {
+	if (bucket < LATENCY_SUB) {
+		return (uint64_t)bucket;
+	}
+	const auto shift = (bucket >> LATENCY_SUB_BITS) - 1;
+	const auto low = (uint64_t)(LATENCY_SUB + (bucket & (LATENCY_SUB - 1))) << shift;
+	return low + ((1ull << shift) >> 1);
+}
+
+// reads the latency of one stack frame. Percentiles are the middle of their
+// bucket, kept between the best and worst call.
+static void ReadLatency(const TraceFile_t& trace, const uint8_t*& p, const stackstats_t& stats, StackFrame_t& frame) {
+	const auto numslowest = (int)ReadVarint(p);
+	frame.numslowest = std::min(numslowest, SLOWEST_CALLS);
+	for (int i = 0; i < numslowest; ++i) {
+		const auto blocknum = (int)ReadVarint(p);
+		const auto time = ReadVarint(p);
+		if (i < SLOWEST_CALLS) {
+			frame.slowest[i] = blocknum;
+			frame.slowestTime[i] = DurationToNanos(trace, time);
+		}
+	}
+
+	std::vector<std::pair<int, uint64_t>> buckets((size_t)ReadVarint(p));
+	uint64_t calls = 0;
+	int bucket = 0;
+	for (auto& it : buckets) {
+		bucket += (int)ReadVarint(p);
+		it.first = bucket;
+		it.second = ReadVarint(p);
+		calls += it.second;
+	}
+
+	for (int i = 0; i < NUM_PERCENTILES; ++i) {
+		const auto rank = std::max<uint64_t>((calls * PERCENTILES[i] + 999) / 1000, 1);
+		uint64_t seen = 0;
+		uint64_t ticks = 0;
+		for (const auto& it : buckets) {
+			seen += it.second;
+			if (seen >= rank) {
+				ticks = LatencyBucketTicks(it.first);
+				break;
+			}
+		}
+		ticks = std::min(std::max(ticks, stats.bestCallTime), stats.worstCallTime);
+		frame.percentiles[i] = calls ? DurationToNanos(trace, ticks) : 0;
+	}
+}
+
+static TimingRecord_t BlockToNanos(const TraceFile_t& trace, TimingRecord_t block) {
+	block.start = ToNanos(trace, block.start);
+	block.end = block.end ? ToNanos(trace, block.end) : 0;
+	block.childtime = DurationToNanos(trace, block.childtime);
+	return block;
+}
+
+// see packedsegment_t in TraceProfiler.cpp.
+static void DecodeSegment(const TraceFile_t& trace, const BlockSegment_t& segment) {
+	auto p = (const uint8_t*)trace.mmap.data() + segment.ofs;
+	auto& blocks = segment.decoded;
+	blocks.resize(segment.numblocks);
+
+	uint64_t start = 0;
+	int numparents = 0;
+	for (int i = 0; i < segment.numblocks; ++i) {
+		auto& block = blocks[i];
+		start += UnZigZag(ReadVarint(p));
+		const auto duration = ReadVarint(p);
+		block.start = ToNanos(trace, start);
+		block.end = duration ? ToNanos(trace, start + duration - 1) : 0;
+		block.childtime = DurationToNanos(trace, ReadVarint(p));
+		const auto stack = ReadVarint(p);
+		block.stackframe = (stack < trace.stackFrameOrder.size()) ? trace.stackFrameOrder[stack] : 0;
+		const auto tag = ReadVarint(p);
+		block.tag = (tag && (tag <= trace.tagOrder.size())) ? trace.tagOrder[tag - 1] : 0;
+		const auto parent = ReadVarint(p);
+		block.parent = parent ? segment.firstblock + i - (int)parent : -1;
+		numparents += (int)UnZigZag(ReadVarint(p));
+		block.numparents = numparents;
+	}
+	assert(p == (const uint8_t*)trace.mmap.data() + segment.ofs + segment.bytes);
+}
+
+static TimingRecord_t GetBlock(const TraceFile_t& trace, int blocknum) {
+	if (trace.version < 3) {
+		return BlockToNanos(trace, trace.blocks[blocknum]);
+	}
+
+	if (!trace.patched.empty()) {
+		const auto it = trace.patched.find(blocknum);
+		if (it != trace.patched.end()) {
+			return BlockToNanos(trace, it->second);
+		}
+	}
+
+	const auto segment = std::upper_bound(trace.segments.begin(), trace.segments.end(), blocknum, [](int num, const BlockSegment_t& s) { return num < s.firstblock; }) - 1;
+	assert(blocknum < (segment->firstblock + segment->numblocks));
+	if (!segment->bytes) {
+		const auto blocks = (const TimingRecord_t*)((const uint8_t*)trace.mmap.data() + segment->ofs);
+		return BlockToNanos(trace, blocks[blocknum - segment->firstblock]);
+	}
+
+	if (segment->decoded.empty()) {
+		DecodeSegment(trace, *segment);
+		++trace.numdecoded;
+	}
+	segment->used = trace.generation;
+	return segment->decoded[blocknum - segment->firstblock];
+}
+
+// frees the decoded segments that weren't needed by the last GenerateSpans()
+// once there are more than MAX_DECODED_SEGMENTS, or all of them when new
+// sync points change how ticks convert.
+static void TrimDecodedSegments(TraceFile_t& trace, bool all) {
+	if (!all && (trace.numdecoded <= MAX_DECODED_SEGMENTS)) {
+		return;
+	}
+	for (auto& segment : trace.segments) {
+		if (!segment.decoded.empty() && (all || (segment.used != trace.generation))) {
+			std::vector<TimingRecord_t>().swap(segment.decoded);
+			--trace.numdecoded;
+		}
+	}
+}
+
+static const int* GetIndexBlock(const TraceFile_t& trace, int index, int& numindices) {
+	if (trace.version < 3) {
+		numindices = trace.indices[index]->numindices;
+		return trace.indices[index]->indices;
+	}
+	numindices = (int)trace.index[index].size();
+	return trace.index[index].data();
+}
+
+static bool IsStackHidden(const TraceFile_t& trace, int stackindex) {
+	return !s_hiddenCategories.empty() && (std::find(s_hiddenCategories.begin(), s_hiddenCategories.end(), trace.stackFrames[stackindex].category) != s_hiddenCategories.end());
+}
+
+static const char* GetTagString(const TraceFile_t& trace, uint32_t tag) {
+	const auto pos = std::lower_bound(trace.tagIDs, trace.tagIDs + trace.numtags, tag);
+	if ((pos != (trace.tagIDs + trace.numtags)) && (*pos == tag)) {
+		return trace.tags[pos - trace.tagIDs].string;
+	}
+	return "";
+}
+
 struct BuildSpan_t {
 	uint64_t start;
 	uint64_t end;
@@ -254,6 +723,9 @@ static void FlushSpan(const TraceFile_t& trace, const BuildSpan_t& span, std::ve
 			if ((pos != (trace.stackFrameIDs + trace.numstacks)) && (*pos == span.stackframe)) {
 				drawspan.stackindex = (int)(pos - trace.stackFrameIDs);
 				drawspan.tagindex = 0;
+				if (IsStackHidden(trace, drawspan.stackindex)) {
+					return;
+				}
 
 				if (span.tag != 0) {
 					const auto tagpos = std::lower_bound(trace.tagIDs, trace.tagIDs + trace.numtags, span.tag);
@@ -292,6 +764,7 @@ inline void AddSpan(const TraceFile_t& trace, BuildSpan_t& span, uint64_t start,
 }
 
 static void GenerateSpans(TraceFile_t& trace) {
+	++trace.generation;
 	for (int i = 0; i < trace.maxparents + 1; ++i) {
 		trace.spans[i].clear();
 	}
@@ -299,35 +772,46 @@ static void GenerateSpans(TraceFile_t& trace) {
 	auto buildSpans = (BuildSpan_t*)alloca(sizeof(BuildSpan_t)*(trace.maxparents + 1));
 	memset(buildSpans, 0, sizeof(BuildSpan_t)*(trace.maxparents + 1));
 
-	for (int i = 0; i < trace.numblocks; ++i) {
-		const auto& block = trace.blocks[i];
-		if (block.end) {
-			break;
-		}
+	// blocks that haven't closed, version 2 files only have them at the start.
+	auto addOpenSpan = [&](const TimingRecord_t& block) {
 		assert(block.numparents <= trace.maxparents);
-		if (((block.start - s_minTicks) < s_vpTimeBounds[1]) && ((trace.micro_end - s_minTicks) > s_vpTimeBounds[0])) {
-			AddSpan(trace, buildSpans[block.numparents], block.start, trace.micro_end, block.stackframe, block.tag, trace.spans[block.numparents]);
+		if (((block.start - s_minTicks) < s_vpTimeBounds[1]) && ((trace.nano_end - s_minTicks) > s_vpTimeBounds[0])) {
+			AddSpan(trace, buildSpans[block.numparents], block.start, trace.nano_end, block.stackframe, block.tag, trace.spans[block.numparents]);
+		}
+	};
+
+	if (trace.version < 3) {
+		for (int i = 0; i < trace.numblocks; ++i) {
+			const auto& block = trace.blocks[i];
+			if (block.end) {
+				break;
+			}
+			addOpenSpan(block);
+		}
+	} else {
+		for (const auto i : trace.open) {
+			addOpenSpan(GetBlock(trace, i));
 		}
 	}
 
-	const auto indexStart = (int)((s_vpTimeBounds[0]+ s_minTicks) / trace.timebase);
-	const auto indexEnd = std::min((int)((s_vpTimeBounds[1] + s_minTicks) / trace.timebase), trace.numindexblocks-1);
+	const auto indexStart = (int)(FromNanos(trace, s_vpTimeBounds[0] + s_minTicks) / trace.timebase);
+	const auto indexEnd = std::min((int)(FromNanos(trace, s_vpTimeBounds[1] + s_minTicks) / trace.timebase), trace.numindexblocks-1);
 
-	const TimingRecord_t* block;
 	if ((indexStart < trace.numindexblocks) && (indexStart <= indexEnd)) {
 		int lastBlockIndex = -1;
 
 		for (auto i = indexStart; i <= indexEnd; ++i) {
-			const auto indices = trace.indices[i];
-			for (auto ii = 0; ii < indices->numindices; ++ii) {
-				const auto blockindex = indices->indices[ii];
+			int numindices;
+			const auto indices = GetIndexBlock(trace, i, numindices);
+			for (auto ii = 0; ii < numindices; ++ii) {
+				const auto blockindex = indices[ii];
 				assert(blockindex < trace.numblocks);
 				if (blockindex > lastBlockIndex) {
 					lastBlockIndex = blockindex;
-					block = &trace.blocks[blockindex];
-					assert(block->numparents <= trace.maxparents);
-					if (!((block->start > (s_vpTimeBounds[1]+s_minTicks)) || (block->end < (s_vpTimeBounds[0]+ s_minTicks)))) {
-						AddSpan(trace, buildSpans[block->numparents], block->start, block->end, block->stackframe, block->tag, trace.spans[block->numparents]);
+					const auto block = GetBlock(trace, blockindex);
+					assert(block.numparents <= trace.maxparents);
+					if (!((block.start > (s_vpTimeBounds[1]+s_minTicks)) || (block.end < (s_vpTimeBounds[0]+ s_minTicks)))) {
+						AddSpan(trace, buildSpans[block.numparents], block.start, block.end, block.stackframe, block.tag, trace.spans[block.numparents]);
 					}
 				}
 			}
@@ -337,6 +821,8 @@ static void GenerateSpans(TraceFile_t& trace) {
 	for (int i = 0; i < trace.maxparents+1; ++i) {
 		FlushSpan(trace, buildSpans[i], trace.spans[i]);
 	}
+
+	TrimDecodedSegments(trace, false);
 }
 
 static void ShowTime(uint64_t time) {
@@ -346,7 +832,7 @@ static void ShowTime(uint64_t time) {
 	} else {
 		time = 0;
 	}
-	s_timeScaleIndex = 4;
+	s_timeScaleIndex = TIMESCALE_CALL;
 	SetTimeScale(s_timeScaleIndex, 0);
 	s_scrollpos = (float)(time / (double)(s_totalTicks - s_vpTimeScale)) * s_totalTicks * s_vpInvTimeScale * s_ww;
 	s_vpTimeBounds[0] = time;
@@ -355,16 +841,491 @@ static void ShowTime(uint64_t time) {
 
 static void ShowCall(const TraceFile_t& trace, int callnum) {
 	s_setSelectedTab = SELECT_TAB_FLAME_CHART;
-	ShowTime(trace.blocks[callnum].start);
+	ShowTime(GetBlock(trace, callnum).start);
 }
 
+// blocks are in the order they were pushed, so the first call is no later
+// than its best, worst or slowest ones. Segments decoded only for the scan
+// are dropped again as it moves on, GenerateSpans() keeps the ones in view.
 static void ShowFirstCall(const TraceFile_t& trace, uint32_t stackid) {
-	for (int i = 0; i < trace.numblocks; ++i) {
-		if (trace.blocks[i].stackframe == stackid) {
-			ShowCall(trace, i);
-			return;
+	auto last = trace.numblocks - 1;
+	const auto pos = std::lower_bound(trace.stackFrameIDs, trace.stackFrameIDs + trace.numstacks, stackid);
+	if ((pos != (trace.stackFrameIDs + trace.numstacks)) && (*pos == stackid)) {
+		const auto& frame = trace.stackFrames[pos - trace.stackFrameIDs];
+		for (const auto call : { frame.bestcall, frame.worstcall }) {
+			if ((call >= 0) && (call < last)) {
+				last = call;
+			}
+		}
+		for (int i = 0; i < frame.numslowest; ++i) {
+			last = std::min(last, frame.slowest[i]);
+		}
+	}
+
+	if (trace.version < 3) {
+		for (int i = 0; i <= last; ++i) {
+			if (GetBlock(trace, i).stackframe == stackid) {
+				ShowCall(trace, i);
+				return;
+			}
+		}
+		return;
+	}
+
+	for (const auto& segment : trace.segments) {
+		if (segment.firstblock > last) {
+			break;
+		}
+		const auto decoded = !segment.decoded.empty();
+		const auto end = std::min(segment.firstblock + segment.numblocks - 1, last);
+		for (int i = segment.firstblock; i <= end; ++i) {
+			if (GetBlock(trace, i).stackframe == stackid) {
+				ShowCall(trace, i);
+				return;
+			}
+		}
+		if (!decoded && !segment.decoded.empty()) {
+			std::vector<TimingRecord_t>().swap(segment.decoded);
+			--trace.numdecoded;
+		}
+	}
+}
+
+// how far the p99 is above the median.
+static double TailRatio(const StackFrame_t& frame) {
+	return frame.percentiles[2] / (double)std::max<uint64_t>(frame.percentiles[0], 1);
+}
+
+static void SortStacks(TraceFile_t& trace) {
+	trace.stacksByWall.clear();
+	for (int i = 0; i < trace.numstacks; ++i) {
+		trace.stacksByWall.push_back(i);
+	}
+
+	trace.stacksByBest = trace.stacksByWall;
+	trace.stacksBySelf = trace.stacksByWall;
+	trace.stacksByWorst = trace.stacksByWall;
+	trace.stacksByTail = trace.stacksByWall;
+
+	std::sort(trace.stacksByWall.begin(), trace.stacksByWall.end(), [&](int a, int b) {
+		return trace.stackFrames[a].wallTime > trace.stackFrames[b].wallTime;
+	});
+
+	std::sort(trace.stacksBySelf.begin(), trace.stacksBySelf.end(), [&](int a, int b) {
+		const auto aself = (trace.stackFrames[a].wallTime - trace.stackFrames[a].childTime);
+		const auto bself = (trace.stackFrames[b].wallTime - trace.stackFrames[b].childTime);
+		return aself > bself;
+	});
+
+	std::sort(trace.stacksByBest.begin(), trace.stacksByBest.end(), [&](int a, int b) {
+		const auto aavg = (trace.stackFrames[a].wallTime / (double)trace.stackFrames[a].callCount);
+		const auto adelta = trace.stackFrames[a].bestCallTime / aavg;
+		const auto bavg = (trace.stackFrames[b].wallTime / (double)trace.stackFrames[b].callCount);
+		const auto bdelta = trace.stackFrames[b].bestCallTime / bavg;
+		return adelta < bdelta;
+	});
+
+	std::sort(trace.stacksByWorst.begin(), trace.stacksByWorst.end(), [&](int a, int b) {
+		const auto aavg = (trace.stackFrames[a].wallTime / (double)trace.stackFrames[a].callCount);
+		const auto adelta = trace.stackFrames[a].worstCallTime / aavg;
+		const auto bavg = (trace.stackFrames[b].wallTime / (double)trace.stackFrames[b].callCount);
+		const auto bdelta = trace.stackFrames[b].worstCallTime / bavg;
+		return adelta > bdelta;
+	});
+
+	std::sort(trace.stacksByTail.begin(), trace.stacksByTail.end(), [&](int a, int b) {
+		return TailRatio(trace.stackFrames[a]) > TailRatio(trace.stackFrames[b]);
+	});
+}
+
+static void UpdateTimeRange() {
+	s_minTicks = s_files.back()->nano_start;
+
+	uint64_t maxticks = 0;
+
+	for (auto& tr : s_files) {
+		s_minTicks = std::min(s_minTicks, tr->nano_start);
+		maxticks = std::max(maxticks, tr->nano_end);
+	}
+
+	s_totalTicks = maxticks - s_minTicks;
+	s_generate = true;
+}
+
+static const size_t COUNTER_GROUP = 16;
+
+static const CounterRange_t& GetCounterEntry(const Counter_t& counter, size_t level, size_t i, CounterRange_t& value) {
+	if (level == 0) {
+		value.min = value.max = counter.values[i];
+		return value;
+	}
+	return counter.levels[level - 1][i];
+}
+
+// redoes the groups from the one sample first is in, the last group of each
+// level may have been partial.
+static void UpdateCounterLevels(Counter_t& counter, size_t first) {
+	auto count = counter.values.size();
+	for (size_t level = 0; count > 1; ++level) {
+		const auto groups = (count + COUNTER_GROUP - 1) / COUNTER_GROUP;
+		if (counter.levels.size() <= level) {
+			counter.levels.emplace_back();
+		}
+		first /= COUNTER_GROUP;
+		counter.levels[level].resize(groups);
+		for (auto g = first; g < groups; ++g) {
+			CounterRange_t range = { DBL_MAX, -DBL_MAX };
+			for (auto i = g * COUNTER_GROUP; i < std::min((g + 1) * COUNTER_GROUP, count); ++i) {
+				CounterRange_t value;
+				const auto& entry = GetCounterEntry(counter, level, i, value);
+				range.min = std::min(range.min, entry.min);
+				range.max = std::max(range.max, entry.max);
+			}
+			counter.levels[level][g] = range;
+		}
+		count = groups;
+	}
+}
+
+// of samples [a, b), the partial groups at either end of each level and
+// whole groups from the level above.
+static CounterRange_t GetCounterRange(const Counter_t& counter, size_t a, size_t b) {
+	CounterRange_t range = { DBL_MAX, -DBL_MAX };
+	for (size_t level = 0; a < b; ++level) {
+		CounterRange_t value;
+		while ((a < b) && (a % COUNTER_GROUP)) {
+			const auto& entry = GetCounterEntry(counter, level, a++, value);
+			range.min = std::min(range.min, entry.min);
+			range.max = std::max(range.max, entry.max);
+		}
+		while ((a < b) && (b % COUNTER_GROUP)) {
+			const auto& entry = GetCounterEntry(counter, level, --b, value);
+			range.min = std::min(range.min, entry.min);
+			range.max = std::max(range.max, entry.max);
 		}
+		a /= COUNTER_GROUP;
+		b /= COUNTER_GROUP;
 	}
+	return range;
+}
+
+// Reads the version 3/4 segments after trace.parsed. Block segments are only
+// used once a complete checkpoint after them has been read, a segment that
+// is cut short or not written yet ends the scan and is read again on the
+// next refresh. Returns true if a checkpoint was read.
+static bool ReadCheckpoints(TraceFile_t& trace) {
+	const auto base = (const uint8_t*)trace.mmap.data();
+	const auto size = (uint64_t)trace.mmap.size();
+
+	std::vector<BlockSegment_t> segments;
+	std::vector<uint64_t> contextSegments;
+	std::vector<uint64_t> counterSegments;
+	bool read = false;
+	auto ofs = trace.parsed;
+
+	while ((ofs + sizeof(segment_t)) <= size) {
+		const auto segment = (const segment_t*)(base + ofs);
+		const auto body = ofs + sizeof(segment_t);
+		if ((segment->magic == 0) || ((body + segment->size) > size)) {
+			break;
+		}
+
+		ofs = body + segment->size;
+
+		if (segment->magic == SEGMENT_BLOCKS) {
+			const auto blocks = (const blocksegment_t*)(base + body);
+			BlockSegment_t seg;
+			seg.firstblock = blocks->firstblock;
+			seg.numblocks = blocks->numblocks;
+			seg.ofs = body + sizeof(blocksegment_t);
+			seg.bytes = 0;
+			seg.used = 0;
+			segments.push_back(seg);
+			continue;
+		}
+
+		if (segment->magic == SEGMENT_PACKED_BLOCKS) {
+			const auto blocks = (const packedsegment_t*)(base + body);
+			BlockSegment_t seg;
+			seg.firstblock = blocks->firstblock;
+			seg.numblocks = blocks->numblocks;
+			seg.ofs = body + sizeof(packedsegment_t);
+			seg.bytes = blocks->bytes;
+			seg.used = 0;
+			segments.push_back(seg);
+			continue;
+		}
+
+		if (segment->magic == SEGMENT_CONTEXTS) {
+			contextSegments.push_back(body);
+			continue;
+		}
+
+		if (segment->magic == SEGMENT_COUNTERS) {
+			counterSegments.push_back(body);
+			continue;
+		}
+
+		if (segment->magic != SEGMENT_CHECKPOINT) {
+			break;
+		}
+
+		const auto checkpoint = (const checkpoint_t*)(base + body);
+		const auto numopen = (checkpoint->numopen + 1) & ~1;
+		const auto numsyncs = (trace.version < 5) ? 0 : checkpoint->numsyncs;
+		const auto stackdefs = (const stackdef_t*)((const uint8_t*)checkpoint + ((trace.version < 5) ? offsetof(checkpoint_t, numsyncs) : sizeof(checkpoint_t)));
+		const auto stackstats = (const uint8_t*)(stackdefs + checkpoint->numstacks);
+		const auto stackstatsSize = (trace.version < 6) ? offsetof(stackstats_t, elidedCalls) : ((trace.version < 7) ? offsetof(stackstats_t, sampledCalls) : sizeof(stackstats_t));
+		const auto tagdefs = (const tagdef_t*)(stackstats + (stackstatsSize * checkpoint->numstackstats));
+		const auto patches = (const patch_t*)(tagdefs + checkpoint->numtags);
+		const auto open = (const int*)(patches + checkpoint->numpatches);
+		const auto indices = (const uint8_t*)(open + numopen);
+		const auto indexbytes = (trace.version < 4) ? sizeof(indexentry_t) * checkpoint->numindices : ((checkpoint->indexbytes + 7) & ~(size_t)7);
+		const auto syncs = (const syncpoint_t*)(indices + indexbytes);
+		const auto latency = (const uint8_t*)(syncs + numsyncs);
+		const auto latencybytes = (trace.version < 8) ? 0 : ((checkpoint->latencybytes + 7) & ~(size_t)7);
+		const auto end = (const checkpointend_t*)(latency + latencybytes);
+
+		if ((((const uint8_t*)(end + 1)) != (base + ofs)) || (end->magic != SEGMENT_CHECKPOINT_END) || (end->numblocks != checkpoint->numblocks)) {
+			break;
+		}
+
+		trace.segments.insert(trace.segments.end(), segments.begin(), segments.end());
+		segments.clear();
+
+		// everything converts a little differently with new sync points.
+		if (numsyncs) {
+			auto& all = trace.syncs;
+			all.insert(all.end(), syncs, syncs + numsyncs);
+			if ((all.size() > 1) && (all.back().tick > all.front().tick)) {
+				trace.nanosPerTick = (all.back().nanos - all.front().nanos) / (double)(all.back().tick - all.front().tick);
+			}
+			TrimDecodedSegments(trace, true);
+		}
+
+		if (checkpoint->numstacks) {
+			for (int i = 0; i < checkpoint->numstacks; ++i) {
+				StackFrame_t frame;
+				memset(&frame, 0, sizeof(frame));
+				memcpy(frame.label, stackdefs[i].label, sizeof(frame.label));
+				memcpy(frame.location, stackdefs[i].location, sizeof(frame.location));
+				frame.category = stackdefs[i].category;
+				trace.stackFrameIDData.push_back(stackdefs[i].id);
+				trace.stackFrameData.push_back(frame);
+				trace.stackFrameOrder.push_back(stackdefs[i].id);
+			}
+
+			std::vector<int> order(trace.stackFrameIDData.size());
+			for (int i = 0; i < (int)order.size(); ++i) {
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&](int a, int b) {
+				return trace.stackFrameIDData[a] < trace.stackFrameIDData[b];
+			});
+
+			std::vector<uint32_t> ids;
+			std::vector<StackFrame_t> frames;
+			ids.reserve(order.size());
+			frames.reserve(order.size());
+			for (const auto i : order) {
+				ids.push_back(trace.stackFrameIDData[i]);
+				frames.push_back(trace.stackFrameData[i]);
+			}
+			trace.stackFrameIDData.swap(ids);
+			trace.stackFrameData.swap(frames);
+		}
+
+		auto packedLatency = latency;
+		for (int i = 0; i < checkpoint->numstackstats; ++i) {
+			const auto& stats = *(const stackstats_t*)(stackstats + (stackstatsSize * i));
+			const auto pos = std::lower_bound(trace.stackFrameIDData.begin(), trace.stackFrameIDData.end(), stats.id);
+			assert((pos != trace.stackFrameIDData.end()) && (*pos == stats.id));
+			auto& frame = trace.stackFrameData[pos - trace.stackFrameIDData.begin()];
+			frame.wallTime = DurationToNanos(trace, stats.wallTime);
+			frame.childTime = DurationToNanos(trace, stats.childTime);
+			frame.callCount = stats.callCount;
+			frame.bestCallTime = DurationToNanos(trace, stats.bestCallTime);
+			frame.worstCallTime = DurationToNanos(trace, stats.worstCallTime);
+			frame.bestcall = stats.bestcall;
+			frame.worstcall = stats.worstcall;
+			frame.elidedCalls = (trace.version < 6) ? 0 : stats.elidedCalls;
+			frame.skippedCalls = 0;
+			if (trace.version >= 8) {
+				ReadLatency(trace, packedLatency, stats, frame);
+			}
+
+			// the skipped calls take the average time of the sampled ones,
+			// their children in the same proportion.
+			if ((trace.version >= 7) && stats.sampledCalls) {
+				const auto skippedTime = stats.skippedCalls * (stats.sampledTime / (double)stats.sampledCalls);
+				if (stats.wallTime) {
+					frame.childTime = DurationToNanos(trace, (uint64_t)(stats.childTime * ((stats.wallTime + skippedTime) / stats.wallTime)));
+				}
+				frame.wallTime = DurationToNanos(trace, stats.wallTime + (uint64_t)skippedTime);
+				frame.callCount += stats.skippedCalls;
+				frame.skippedCalls = stats.skippedCalls;
+			}
+		}
+
+		// see contextsegment_t in TraceProfiler.cpp, the nodes' stack frames
+		// were defined by this checkpoint at the latest.
+		for (const auto contextofs : contextSegments) {
+			const auto contexts = (const contextsegment_t*)(base + contextofs);
+			auto p = (const uint8_t*)(contexts + 1);
+			assert(contexts->firstnode == (int)trace.contexts.size());
+			for (int i = 0; i < contexts->numnodes; ++i) {
+				Context_t context;
+				memset(&context, 0, sizeof(context));
+				context.parent = (int)ReadVarint(p) - 1;
+				context.stackframe = trace.stackFrameOrder[(size_t)ReadVarint(p)];
+				trace.contexts.push_back(context);
+			}
+			int node = 0;
+			for (int i = 0; i < contexts->numchanged; ++i) {
+				node += (int)ReadVarint(p);
+				auto& context = trace.contexts[node];
+				context.callCount = ReadVarint(p);
+				context.wallTime = DurationToNanos(trace, ReadVarint(p));
+				context.childTime = DurationToNanos(trace, ReadVarint(p));
+			}
+			s_mergeContexts = true;
+		}
+		contextSegments.clear();
+
+		// see countersegment_t in TraceProfiler.cpp, each segment's values
+		// start over from 0.
+		if (!counterSegments.empty()) {
+			std::vector<size_t> firsts;
+			for (const auto& counter : trace.counters) {
+				firsts.push_back(counter.values.size());
+			}
+			for (const auto counterofs : counterSegments) {
+				const auto counters = (const countersegment_t*)(base + counterofs);
+				const auto defs = (const counterdef_t*)(counters + 1);
+				for (int i = 0; i < counters->numcounters; ++i) {
+					Counter_t counter;
+					counter.id = defs[i].id;
+					counter.category = defs[i].category;
+					counter.type = defs[i].type;
+					memcpy(counter.label, defs[i].label, sizeof(counter.label));
+					memcpy(counter.location, defs[i].location, sizeof(counter.location));
+					trace.counters.push_back(std::move(counter));
+					firsts.push_back(0);
+				}
+				std::vector<uint64_t> previous(trace.counters.size(), 0);
+				auto p = (const uint8_t*)(defs + counters->numcounters);
+				uint64_t tick = 0;
+				for (int i = 0; i < counters->numsamples; ++i) {
+					const auto index = (size_t)ReadVarint(p);
+					auto& counter = trace.counters[index];
+					tick += UnZigZag(ReadVarint(p));
+					double value;
+					if (counter.type == COUNTER_DOUBLE) {
+						previous[index] ^= ReadVarint(p);
+						memcpy(&value, &previous[index], sizeof(value));
+					} else {
+						previous[index] += UnZigZag(ReadVarint(p));
+						value = (double)(int64_t)previous[index];
+					}
+					counter.ticks.push_back(tick);
+					counter.values.push_back(value);
+				}
+			}
+			for (size_t i = 0; i < trace.counters.size(); ++i) {
+				UpdateCounterLevels(trace.counters[i], firsts[i]);
+			}
+		}
+		counterSegments.clear();
+
+		if (checkpoint->numtags) {
+			std::vector<std::pair<uint32_t, int>> order;
+			for (int i = 0; i < (int)trace.tagIDData.size(); ++i) {
+				order.emplace_back(trace.tagIDData[i], -(i + 1));
+			}
+			for (int i = 0; i < checkpoint->numtags; ++i) {
+				order.emplace_back(tagdefs[i].id, i);
+				trace.tagOrder.push_back(tagdefs[i].id);
+			}
+			std::sort(order.begin(), order.end());
+
+			std::vector<uint32_t> ids;
+			std::vector<Tag_t> tags;
+			for (const auto& it : order) {
+				Tag_t tag;
+				if (it.second < 0) {
+					tag = trace.tagData[-(it.second + 1)];
+				} else {
+					memcpy(tag.string, tagdefs[it.second].string, sizeof(tag.string));
+				}
+				ids.push_back(it.first);
+				tags.push_back(tag);
+			}
+			trace.tagIDData.swap(ids);
+			trace.tagData.swap(tags);
+		}
+
+		for (int i = 0; i < checkpoint->numpatches; ++i) {
+			trace.patched[patches[i].blocknum] = patches[i].block;
+		}
+
+		trace.open.assign(open, open + checkpoint->numopen);
+
+		{
+			std::vector<int> touched;
+			auto packed = indices;
+			indexentry_t entry = {};
+			for (int i = 0; i < checkpoint->numindices; ++i) {
+				if (trace.version < 4) {
+					entry = ((const indexentry_t*)indices)[i];
+				} else {
+					entry.index += (int)UnZigZag(ReadVarint(packed));
+					entry.blocknum += (int)UnZigZag(ReadVarint(packed));
+				}
+				if (entry.index >= (int)trace.index.size()) {
+					trace.index.resize(entry.index + 1);
+				}
+				trace.index[entry.index].push_back(entry.blocknum);
+				touched.push_back(entry.index);
+			}
+			std::sort(touched.begin(), touched.end());
+			touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+			for (const auto i : touched) {
+				std::sort(trace.index[i].begin(), trace.index[i].end());
+			}
+		}
+
+		trace.numstacks = (int)trace.stackFrameIDData.size();
+		trace.numtags = (int)trace.tagIDData.size();
+		trace.numblocks = checkpoint->numblocks;
+		trace.numindexblocks = (int)trace.index.size();
+		trace.nano_start = ToNanos(trace, checkpoint->micro_start);
+		trace.nano_end = ToNanos(trace, checkpoint->micro_end);
+		trace.final = checkpoint->final != 0;
+
+		trace.stackFrameIDs = trace.stackFrameIDData.data();
+		trace.stackFrames = trace.stackFrameData.data();
+		trace.tagIDs = trace.tagIDData.data();
+		trace.tags = trace.tagData.data();
+
+		if (!trace.spans || (checkpoint->maxparents > trace.maxparents)) {
+			delete[] trace.spans;
+			trace.maxparents = checkpoint->maxparents;
+			trace.spans = new std::vector<Span_t>[trace.maxparents + 1];
+		}
+
+		trace.parsed = ofs;
+		read = true;
+
+		if (trace.final) {
+			break;
+		}
+	}
+
+	if (read) {
+		SortStacks(trace);
+	}
+
+	return read;
 }
 
 static void OpenTraceFile(const char* nativePath) {
@@ -382,23 +1343,6 @@ static void OpenTraceFile(const char* nativePath) {
 		return;
 	}
 
-	struct header_t {
-		uint32_t magic;
-		uint32_t version;
-		int numstacks;
-		int numtags;
-		int numblocks;
-		int numindexblocks;
-		int maxparents;
-		int padd;
-		uint64_t stackofs;
-		uint64_t tagofs;
-		uint64_t indexofs;
-		uint64_t micro_start;
-		uint64_t micro_end;
-		uint64_t timebase;
-	};
-
 	const auto base = (const uint8_t*)mmap.data();
 	const auto header = (const header_t*)base;
 
@@ -407,7 +1351,7 @@ static void OpenTraceFile(const char* nativePath) {
 		return;
 	}
 
-	if (header->version != 2) {
+	if ((header->version < 2) || (header->version > 10)) {
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "Unsupported file version, cannot open file.", s_window);
 		return;
 	}
@@ -416,6 +1360,23 @@ static void OpenTraceFile(const char* nativePath) {
 	auto& trace = *s_files.back();
 	strcpy_s(trace.path, nativePath);
 	trace.collapsed = false;
+	trace.version = header->version;
+	trace.timebase = header->timebase;
+	trace.nanosPerTick = 1;
+
+	if (trace.version >= 3) {
+		trace.mmap = std::move(mmap);
+		trace.parsed = sizeof(header_t);
+		trace.numdecoded = 0;
+		trace.generation = 0;
+		if (!ReadCheckpoints(trace)) {
+			s_files.pop_back();
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "No checkpoint has been written yet, cannot open file.", s_window);
+			return;
+		}
+		UpdateTimeRange();
+		return;
+	}
 
 	trace.mmap = std::move(mmap);
 	trace.numstacks = header->numstacks;
@@ -423,13 +1384,31 @@ static void OpenTraceFile(const char* nativePath) {
 	trace.numblocks = header->numblocks;
 	trace.numindexblocks = header->numindexblocks;
 	trace.maxparents = header->maxparents;
-	trace.micro_start = header->micro_start;
-	trace.micro_end = header->micro_end;
-	trace.timebase = header->timebase;
+	trace.nano_start = ToNanos(trace, header->micro_start);
+	trace.nano_end = ToNanos(trace, header->micro_end);
+	trace.final = true;
 
 	trace.blocks = (const TimingRecord_t*)(base + sizeof(header_t));
 	trace.stackFrameIDs = (const uint32_t*)(base + header->stackofs);
-	trace.stackFrames = (const StackFrame_t*)(base + header->stackofs + (sizeof(uint32_t) * header->numstacks));
+	{
+		// microseconds in the file.
+		const auto frames = (const stackframe_t*)(base + header->stackofs + (sizeof(uint32_t) * header->numstacks));
+		trace.stackFrameData.resize(header->numstacks);
+		for (int i = 0; i < header->numstacks; ++i) {
+			auto& frame = trace.stackFrameData[i];
+			memset(&frame, 0, sizeof(frame));
+			memcpy(frame.label, frames[i].label, sizeof(frame.label));
+			memcpy(frame.location, frames[i].location, sizeof(frame.location));
+			frame.wallTime = DurationToNanos(trace, frames[i].wallTime);
+			frame.childTime = DurationToNanos(trace, frames[i].childTime);
+			frame.callCount = frames[i].callCount;
+			frame.bestCallTime = DurationToNanos(trace, frames[i].bestCallTime);
+			frame.worstCallTime = DurationToNanos(trace, frames[i].worstCallTime);
+			frame.bestcall = frames[i].bestcall;
+			frame.worstcall = frames[i].worstcall;
+		}
+		trace.stackFrames = trace.stackFrameData.data();
+	}
 	trace.tagIDs = (const uint32_t*)(base + header->tagofs);
 	trace.tags = (const Tag_t*)(base + header->tagofs + (sizeof(uint32_t) * header->numtags));
 	trace.indices = (const IndexBlock_t**)malloc(sizeof(IndexBlock_t*) * header->numindexblocks);
@@ -443,53 +1422,46 @@ static void OpenTraceFile(const char* nativePath) {
 		}
 	}
 
-	for (int i = 0; i < trace.numstacks; ++i) {
-		trace.stacksByWall.push_back(i);
-	}
+	SortStacks(trace);
 
-	trace.stacksByBest = trace.stacksByWall;
-	trace.stacksBySelf = trace.stacksByWall;
-	trace.stacksByWorst = trace.stacksByWall;
-
-	std::sort(trace.stacksByWall.begin(), trace.stacksByWall.end(), [&](int a, int b) {
-		return trace.stackFrames[a].wallTime > trace.stackFrames[b].wallTime;
-	});
+	trace.spans = new std::vector<Span_t>[trace.maxparents + 1];
 
-	std::sort(trace.stacksBySelf.begin(), trace.stacksBySelf.end(), [&](int a, int b) {
-		const auto aself = (trace.stackFrames[a].wallTime - trace.stackFrames[a].childTime);
-		const auto bself = (trace.stackFrames[b].wallTime - trace.stackFrames[b].childTime);
-		return aself > bself;
-	});
+	UpdateTimeRange();
+}
 
-	std::sort(trace.stacksByBest.begin(), trace.stacksByBest.end(), [&](int a, int b) {
-		const auto aavg = (trace.stackFrames[a].wallTime / (double)trace.stackFrames[a].callCount);
-		const auto adelta = trace.stackFrames[a].bestCallTime / aavg;
-		const auto bavg = (trace.stackFrames[b].wallTime / (double)trace.stackFrames[b].callCount);
-		const auto bdelta = trace.stackFrames[b].bestCallTime / bavg;
-		return adelta < bdelta;
-	});
+// remaps files that are still being written and reads any new checkpoints.
+static void RefreshTraceFiles() {
+	static uint32_t lastRefresh;
 
-	std::sort(trace.stacksByWorst.begin(), trace.stacksByWorst.end(), [&](int a, int b) {
-		const auto aavg = (trace.stackFrames[a].wallTime / (double)trace.stackFrames[a].callCount);
-		const auto adelta = trace.stackFrames[a].worstCallTime / aavg;
-		const auto bavg = (trace.stackFrames[b].wallTime / (double)trace.stackFrames[b].callCount);
-		const auto bdelta = trace.stackFrames[b].worstCallTime / bavg;
-		return adelta > bdelta;
-	});
+	const auto now = SDL_GetTicks();
+	if ((now - lastRefresh) < REFRESH_INTERVAL_IN_MS) {
+		return;
+	}
+	lastRefresh = now;
 
-	trace.spans = new std::vector<Span_t>[trace.maxparents + 1];
+	bool changed = false;
 
-	s_minTicks = trace.micro_start;
+	for (auto& tf : s_files) {
+		auto& trace = *tf;
+		if (trace.final) {
+			continue;
+		}
 
-	uint64_t maxticks = 0;
+		std::error_code error;
+		auto mmap = mio::make_mmap_source(trace.path, error);
+		if (error || (mmap.size() <= trace.parsed)) {
+			continue;
+		}
 
-	for (auto& tr : s_files) {
-		s_minTicks = std::min(s_minTicks, tr->micro_start);
-		maxticks = std::max(maxticks, tr->micro_end);
+		trace.mmap = std::move(mmap);
+		if (ReadCheckpoints(trace)) {
+			changed = true;
+		}
 	}
 
-	s_totalTicks = maxticks - s_minTicks;
-	s_generate = true;
+	if (changed) {
+		UpdateTimeRange();
+	}
 }
 
 static bool CollapseButton(ImGuiID id, const ImVec2& pos, bool collapsed) {
@@ -718,6 +1690,86 @@ static bool Selectable(const char* label, bool* p_selected, ImGuiSelectableFlags
 	return false;
 }
 
+static bool IsCounterHidden(const Counter_t& counter) {
+	return !s_hiddenCategories.empty() && (std::find(s_hiddenCategories.begin(), s_hiddenCategories.end(), counter.category) != s_hiddenCategories.end());
+}
+
+// a lane per counter below the spans, each pixel column is a bar from the
+// smallest to the largest value it covers, including the one held from
+// before it, so zoomed out it shows the range and zoomed in a step line.
+static void DrawCounters(const TraceFile_t& trace, float x, float& y) {
+	static constexpr float COUNTER_HEIGHT = 40;
+	static constexpr float TRACK_SPACE = 5;
+
+	const auto numcolumns = std::max((int)s_ww, 1);
+	std::vector<uint64_t> columnTicks(numcolumns + 1);
+	for (int i = 0; i <= numcolumns; ++i) {
+		columnTicks[i] = FromNanos(trace, s_minTicks + s_vpTimeBounds[0] + (uint64_t)(i * (double)s_vpTimeScale / numcolumns));
+	}
+	const auto endTick = FromNanos(trace, trace.nano_end);
+
+	auto drawList = ImGui::GetWindowDrawList();
+	for (const auto& counter : trace.counters) {
+		if (IsCounterHidden(counter) || counter.ticks.empty()) {
+			continue;
+		}
+
+		ImGui::SetCursorPos(ImVec2(x, y));
+		const auto origin = ImGui::GetCursorScreenPos();
+		ImGui::PushID(&counter);
+		ImGui::InvisibleButton("##counter", ImVec2((float)numcolumns, COUNTER_HEIGHT));
+		const auto hovered = ImGui::IsItemHovered();
+		ImGui::PopID();
+		y += COUNTER_HEIGHT + TRACK_SPACE;
+
+		const auto& ticks = counter.ticks;
+		drawList->AddRectFilled(origin, ImVec2(origin.x + numcolumns, origin.y + COUNTER_HEIGHT), ImGui::GetColorU32(ImGuiCol_FrameBg));
+
+		// scaled to what's visible, the value held into the view included.
+		const auto first = (size_t)(std::lower_bound(ticks.begin(), ticks.end(), columnTicks[0]) - ticks.begin());
+		const auto last = (size_t)(std::lower_bound(ticks.begin(), ticks.end(), columnTicks[numcolumns]) - ticks.begin());
+		if (last > 0) {
+			const auto visible = GetCounterRange(counter, first ? first - 1 : 0, last);
+			const auto height = COUNTER_HEIGHT - 2;
+			const auto scale = (visible.max > visible.min) ? height / (visible.max - visible.min) : 0.0;
+			const auto toY = [&](double value) {
+				return origin.y + 1 + ((scale != 0) ? (float)((visible.max - value) * scale) : height * 0.5f);
+			};
+
+			const auto color = (ImU32)(counter.id | 0xFF000000);
+			auto a = first;
+			for (int i = 0; i < numcolumns; ++i) {
+				if (columnTicks[i] > endTick) {
+					break;
+				}
+				const auto b = (size_t)(std::lower_bound(ticks.begin() + a, ticks.end(), columnTicks[i + 1]) - ticks.begin());
+				if (b > 0) {
+					const auto range = GetCounterRange(counter, a ? a - 1 : 0, b);
+					drawList->AddRectFilled(ImVec2(origin.x + i, toY(range.max)), ImVec2(origin.x + i + 1, toY(range.min) + 1), color);
+				}
+				a = b;
+			}
+		}
+
+		drawList->AddText(ImVec2(origin.x + 4, origin.y + 2), ImGui::GetColorU32(ImGuiCol_Text), counter.label);
+
+		if (hovered) {
+			const auto column = std::min(std::max((int)(ImGui::GetMousePos().x - origin.x), 0), numcolumns - 1);
+			const auto at = std::upper_bound(ticks.begin(), ticks.end(), columnTicks[column + 1]) - ticks.begin();
+			if (at > 0) {
+				const auto value = counter.values[at - 1];
+				ImGui::SetTooltip(
+					(counter.type == COUNTER_DOUBLE) ? "[%s]\n[%s]\n\nValue: [%g]\nAt: [%.3f us]" : "[%s]\n[%s]\n\nValue: [%.0f]\nAt: [%.3f us]",
+					counter.label,
+					counter.location,
+					value,
+					ToNanos(trace, ticks[at - 1]) / 1000.0
+				);
+			}
+		}
+	}
+}
+
 static void DrawTrace(TraceFile_t& trace) {
 	static constexpr float TRACK_HEIGHT = 30;
 	static constexpr float TRACK_SPACE = 5;
@@ -757,14 +1809,14 @@ static void DrawTrace(TraceFile_t& trace) {
 					const auto delta = span.end - span.start;
 
 					ImGui::SetTooltip(
-						"[%s]\n[%s]\n[%s]\n\nWall Time: [%.2f ms] [%u us]\nStart: [%u us]\nEnd: [%u us]",
+						"[%s]\n[%s]\n[%s]\n\nWall Time: [%.3f ms] [%.3f us]\nStart: [%.3f us]\nEnd: [%.3f us]",
 						trace.stackFrames[span.stackindex].label,
 						trace.stackFrames[span.stackindex].location,
 						(span.tagindex != 0) ? trace.tags[span.tagindex-1].string : "<untagged>",
-						delta / 1000.f,
-						delta,
-						span.start,
-						span.end
+						delta / 1000000.0,
+						delta / 1000.0,
+						span.start / 1000.0,
+						span.end / 1000.0
 					);
 				}
 				ImGui::PopID();
@@ -773,6 +1825,143 @@ static void DrawTrace(TraceFile_t& trace) {
 			}
 			size.y += TRACK_HEIGHT + TRACK_SPACE;
 		}
+
+		if (!trace.counters.empty()) {
+			DrawCounters(trace, pos.x, size.y);
+		}
+	}
+}
+
+// one checkbox per category in the open files, none if there's only one.
+static void DrawCategoryFilter() {
+	std::vector<std::pair<uint32_t, const char*>> categories;
+	for (const auto& trace : s_files) {
+		for (int i = 0; i < trace->numstacks; ++i) {
+			const auto category = trace->stackFrames[i].category;
+			if (std::find_if(categories.begin(), categories.end(), [&](const std::pair<uint32_t, const char*>& c) { return c.first == category; }) == categories.end()) {
+				categories.emplace_back(category, category ? GetTagString(*trace, category) : "<no category>");
+			}
+		}
+		for (const auto& counter : trace->counters) {
+			const auto category = counter.category;
+			if (std::find_if(categories.begin(), categories.end(), [&](const std::pair<uint32_t, const char*>& c) { return c.first == category; }) == categories.end()) {
+				categories.emplace_back(category, category ? GetTagString(*trace, category) : "<no category>");
+			}
+		}
+	}
+
+	if (categories.size() < 2) {
+		return;
+	}
+
+	std::sort(categories.begin(), categories.end(), [](const std::pair<uint32_t, const char*>& a, const std::pair<uint32_t, const char*>& b) {
+		return strcmp(a.second, b.second) < 0;
+	});
+
+	for (const auto& category : categories) {
+		const auto hidden = std::find(s_hiddenCategories.begin(), s_hiddenCategories.end(), category.first);
+		bool shown = hidden == s_hiddenCategories.end();
+		ImGui::PushID((int)category.first);
+		if (ImGui::Checkbox(category.second, &shown)) {
+			if (shown) {
+				s_hiddenCategories.erase(hidden);
+			} else {
+				s_hiddenCategories.push_back(category.first);
+			}
+			s_generate = true;
+		}
+		ImGui::PopID();
+		ImGui::SameLine();
+	}
+	ImGui::NewLine();
+}
+
+// the calling context trees of every open file merged by the path of stack
+// frame ids, so threads and captures of the same code add up.
+struct MergedContext_t {
+	uint32_t stackframe;
+	uint32_t category;
+	char label[256]; // copied, checkpoints that define stack frames rebuild the file's table
+	uint64_t callCount;
+	uint64_t wallTime;
+	uint64_t childTime;
+	std::vector<int> children; // by wall time
+};
+
+static std::vector<MergedContext_t> s_contexts;
+static std::vector<int> s_contextRoots;
+
+static void MergeContexts() {
+	s_contexts.clear();
+	s_contextRoots.clear();
+
+	std::unordered_map<uint64_t, int> merged; // parent + 1 and stack frame id
+	std::vector<int> mapped;
+	for (const auto& trace : s_files) {
+		mapped.resize(trace->contexts.size());
+		for (int i = 0; i < (int)trace->contexts.size(); ++i) {
+			// parents always come before their children.
+			const auto& context = trace->contexts[i];
+			const auto parent = (context.parent >= 0) ? mapped[context.parent] : -1;
+			const auto key = ((uint64_t)(parent + 1) << 32) | context.stackframe;
+			const auto it = merged.find(key);
+			if (it != merged.end()) {
+				mapped[i] = it->second;
+			} else {
+				const auto pos = std::lower_bound(trace->stackFrameIDs, trace->stackFrameIDs + trace->numstacks, context.stackframe);
+				const auto& frame = trace->stackFrames[pos - trace->stackFrameIDs];
+
+				MergedContext_t node;
+				node.stackframe = context.stackframe;
+				node.category = frame.category;
+				memcpy(node.label, frame.label, sizeof(node.label));
+				node.callCount = 0;
+				node.wallTime = 0;
+				node.childTime = 0;
+
+				mapped[i] = (int)s_contexts.size();
+				merged[key] = mapped[i];
+				s_contexts.push_back(node);
+				if (parent >= 0) {
+					s_contexts[parent].children.push_back(mapped[i]);
+				} else {
+					s_contextRoots.push_back(mapped[i]);
+				}
+			}
+
+			auto& node = s_contexts[mapped[i]];
+			node.callCount += context.callCount;
+			node.wallTime += context.wallTime;
+			node.childTime += context.childTime;
+		}
+	}
+
+	const auto byWall = [](int a, int b) {
+		return s_contexts[a].wallTime > s_contexts[b].wallTime;
+	};
+	for (auto& node : s_contexts) {
+		std::sort(node.children.begin(), node.children.end(), byWall);
+	}
+	std::sort(s_contextRoots.begin(), s_contextRoots.end(), byWall);
+}
+
+static void DrawContext(int idx) {
+	const auto& node = s_contexts[idx];
+	if (std::find(s_hiddenCategories.begin(), s_hiddenCategories.end(), node.category) != s_hiddenCategories.end()) {
+		return;
+	}
+
+	const auto flags = node.children.empty() ? (ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen) : 0;
+	const auto open = ImGui::TreeNodeEx((void*)(intptr_t)idx, flags, "%s  [%.3f ms]  [self %.3f ms]  [%llu calls]",
+		node.label,
+		node.wallTime / 1000000.0,
+		(node.wallTime - node.childTime) / 1000000.0,
+		(unsigned long long)node.callCount);
+	if (open && !node.children.empty()) {
+		for (const auto child : node.children) {
+			DrawContext(child);
+		}
+		ImGui::TreePop();
 	}
 }
 
@@ -790,6 +1979,7 @@ static void DrawFrame(float ww, float wh) {
 	ImGui::PushStyleColor(ImGuiCol_WindowBg, ImVec4(0.1f, 0.1f, 0.1f, 1.f));
 
 	ImGui::Begin("##TraceViewerMain", nullptr, ImGuiWindowFlags_NoBringToFrontOnFocus | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoTitleBar);
+	DrawCategoryFilter();
 	if (ImGui::BeginTabBar("Main Tabs")) {
 		if (ImGui::BeginTabItem("Flame Chart", nullptr, (s_setSelectedTab==SELECT_TAB_FLAME_CHART) ? ImGuiTabItemFlags_SetSelected : 0)) {
 			if (s_setSelectedTab == SELECT_TAB_FLAME_CHART) {
@@ -873,14 +2063,17 @@ static void DrawFrame(float ww, float wh) {
 				}
 
 				for (auto& trace : s_files) {
-					const double total = (double)(trace->micro_end - trace->micro_start);
+					const double total = (double)(trace->nano_end - trace->nano_start);
 
 					Selectable(trace->path, false, ImGuiSelectableFlags_Disabled, ImVec2(1, 0), ImGui::GetColorU32(ImGuiCol_Header));
 
 					ImGui::Columns(numColumns, NULL, false);
 
 					for (int i = 0; i < trace->numstacks; i++) {
-						
+						if (IsStackHidden(*trace, trace->stacksByWall[i])) {
+							continue;
+						}
+
 						const auto& stackframe = trace->stackFrames[trace->stacksByWall[i]];
 						const auto rgbmask = (ImU32)(trace->stackFrameIDs[trace->stacksByWall[i]] | 0xFF000000);
 						const auto frac = (float)(stackframe.wallTime / total);
@@ -889,6 +2082,9 @@ static void DrawFrame(float ww, float wh) {
 						if (Selectable(stackframe.label, false, 0, ImVec2(frac, 0), rgbmask)) {
 							ShowFirstCall(*trace, trace->stackFrameIDs[trace->stacksByWall[i]]);
 						}
+						if ((stackframe.elidedCalls || stackframe.skippedCalls) && ImGui::IsItemHovered()) {
+							ImGui::SetTooltip("%llu calls, %llu elided, %llu estimated from samples", (unsigned long long)stackframe.callCount, (unsigned long long)stackframe.elidedCalls, (unsigned long long)stackframe.skippedCalls);
+						}
 						ImGui::PopID();
 
 						if ((ImGui::GetCursorPosY() - pos) >= space) {
@@ -921,13 +2117,16 @@ static void DrawFrame(float ww, float wh) {
 				}
 
 				for (auto& trace : s_files) {
-					const double total = (double)(trace->micro_end - trace->micro_start);
+					const double total = (double)(trace->nano_end - trace->nano_start);
 
 					Selectable(trace->path, false, ImGuiSelectableFlags_Disabled, ImVec2(1, 0), ImGui::GetColorU32(ImGuiCol_Header));
 
 					ImGui::Columns(numColumns, NULL, false);
 
 					for (int i = 0; i < trace->numstacks; i++) {
+						if (IsStackHidden(*trace, trace->stacksBySelf[i])) {
+							continue;
+						}
 
 						const auto& stackframe = trace->stackFrames[trace->stacksBySelf[i]];
 						const auto rgbmask = (ImU32)(trace->stackFrameIDs[trace->stacksBySelf[i]] | 0xFF000000);
@@ -969,13 +2168,16 @@ static void DrawFrame(float ww, float wh) {
 				}
 
 				for (auto& trace : s_files) {
-					const double total = (double)(trace->micro_end - trace->micro_start);
+					const double total = (double)(trace->nano_end - trace->nano_start);
 
 					Selectable(trace->path, false, ImGuiSelectableFlags_Disabled, ImVec2(1, 0), ImGui::GetColorU32(ImGuiCol_Header));
 
 					ImGui::Columns(numColumns, NULL, false);
 
 					for (int i = 0; i < trace->numstacks; i++) {
+						if (IsStackHidden(*trace, trace->stacksByBest[i])) {
+							continue;
+						}
 
 						const auto& stackframe = trace->stackFrames[trace->stacksByBest[i]];
 						const auto rgbmask = (ImU32)(trace->stackFrameIDs[trace->stacksByBest[i]] | 0xFF000000);
@@ -983,7 +2185,7 @@ static void DrawFrame(float ww, float wh) {
 						const auto delta = 1.f-(float)std::min(stackframe.bestCallTime / avg, 1.);
 
 						ImGui::PushID(&stackframe);
-						if (Selectable(stackframe.label, false, 0, ImVec2(delta, 0), rgbmask)) {
+						if (Selectable(stackframe.label, false, 0, ImVec2(delta, 0), rgbmask) && (stackframe.bestcall >= 0)) {
 							ShowCall(*trace, stackframe.bestcall);
 						}
 						ImGui::PopID();
@@ -1018,13 +2220,16 @@ static void DrawFrame(float ww, float wh) {
 				}
 
 				for (auto& trace : s_files) {
-					const double total = (double)(trace->micro_end - trace->micro_start);
+					const double total = (double)(trace->nano_end - trace->nano_start);
 
 					Selectable(trace->path, false, ImGuiSelectableFlags_Disabled, ImVec2(1, 0), ImGui::GetColorU32(ImGuiCol_Header));
 
 					ImGui::Columns(numColumns, NULL, false);
 
 					for (int i = 0; i < trace->numstacks; i++) {
+						if (IsStackHidden(*trace, trace->stacksByWorst[i])) {
+							continue;
+						}
 
 						const auto& stackframe = trace->stackFrames[trace->stacksByWorst[i]];
 						const auto rgbmask = (ImU32)(trace->stackFrameIDs[trace->stacksByWorst[i]] | 0xFF000000);
@@ -1032,7 +2237,7 @@ static void DrawFrame(float ww, float wh) {
 						const auto delta = (float)std::min(stackframe.worstCallTime / avg, 8.0) / 8.f;
 
 						ImGui::PushID(&stackframe);
-						if (Selectable(stackframe.label, false, 0, ImVec2(delta, 0), rgbmask)) {
+						if (Selectable(stackframe.label, false, 0, ImVec2(delta, 0), rgbmask) && (stackframe.worstcall >= 0)) {
 							ShowCall(*trace, stackframe.worstcall);
 						}
 						ImGui::PopID();
@@ -1047,6 +2252,84 @@ static void DrawFrame(float ww, float wh) {
 			}
 			ImGui::EndTabItem();
 		}
+		if (ImGui::BeginTabItem("Tail Latency")) {
+			if (!s_files.empty()) {
+				const auto numblocks = (int)s_files.size();
+
+				int numitems = 0;
+				for (auto& trace : s_files) {
+					numitems += trace->numstacks;
+				}
+
+				const float predictedItemSize = (g.FontSize + style.ItemSpacing.y) * (numblocks + numitems);
+
+				const auto pos = ImGui::GetCursorPosY();
+				const auto space = ImGui::GetContentRegionAvail().y / numblocks;
+
+				int numColumns = 1;
+				if (predictedItemSize > space) {
+					numColumns = std::max((int)(predictedItemSize / space) + 1, 4);
+				}
+
+				for (auto& trace : s_files) {
+					Selectable(trace->path, false, ImGuiSelectableFlags_Disabled, ImVec2(1, 0), ImGui::GetColorU32(ImGuiCol_Header));
+
+					ImGui::Columns(numColumns, NULL, false);
+
+					for (int i = 0; i < trace->numstacks; i++) {
+						// files before version 8 and stack frames without recorded calls have no histogram.
+						const auto& stackframe = trace->stackFrames[trace->stacksByTail[i]];
+						if (IsStackHidden(*trace, trace->stacksByTail[i]) || !stackframe.numslowest) {
+							continue;
+						}
+
+						const auto rgbmask = (ImU32)(trace->stackFrameIDs[trace->stacksByTail[i]] | 0xFF000000);
+						const auto delta = (float)std::min(TailRatio(stackframe), 8.0) / 8.f;
+
+						ImGui::PushID(&stackframe);
+						if (Selectable(stackframe.label, false, 0, ImVec2(delta, 0), rgbmask)) {
+							ImGui::OpenPopup("slowest");
+						}
+						if (ImGui::IsItemHovered()) {
+							ImGui::SetTooltip("p50: [%.3f us]\np90: [%.3f us]\np99: [%.3f us]\np99.9: [%.3f us]\n\nClick for the slowest calls.",
+								stackframe.percentiles[0] / 1000.0,
+								stackframe.percentiles[1] / 1000.0,
+								stackframe.percentiles[2] / 1000.0,
+								stackframe.percentiles[3] / 1000.0);
+						}
+						if (ImGui::BeginPopup("slowest")) {
+							for (int k = 0; k < stackframe.numslowest; ++k) {
+								char label[64];
+								snprintf(label, sizeof(label), "%.3f ms##%i", stackframe.slowestTime[k] / 1000000.0, k);
+								if (ImGui::Selectable(label)) {
+									ShowCall(*trace, stackframe.slowest[k]);
+								}
+							}
+							ImGui::EndPopup();
+						}
+						ImGui::PopID();
+
+						if ((ImGui::GetCursorPosY() - pos) >= space) {
+							ImGui::NextColumn();
+						}
+					}
+
+					ImGui::Columns(1);
+				}
+			}
+			ImGui::EndTabItem();
+		}
+		if (ImGui::BeginTabItem("Calling Context")) {
+			// files before version 9 have no tree.
+			if (s_mergeContexts) {
+				MergeContexts();
+				s_mergeContexts = false;
+			}
+			for (const auto root : s_contextRoots) {
+				DrawContext(root);
+			}
+			ImGui::EndTabItem();
+		}
 		
 		ImGui::EndTabBar();
 	}
@@ -1193,14 +2476,15 @@ int main(int, char**) {
 			s_oldvpTimeBounds = s_vpTimeBounds;
 			s_ww = io.DisplaySize.x;
 			s_wh = io.DisplaySize.y;
-			s_timeScaleIndex = 10;
-			SetTimeScale(10, 0);
+			s_timeScaleIndex = TIMESCALE_DEFAULT;
+			SetTimeScale(s_timeScaleIndex, 0);
 
 			//OpenTraceFile("F:\\Projects\\Dracarys5\\Temp\\Traces\\trace_00000.Main.19228.trace");
 		}
 
 		// 1. Show the big demo window (Most of the sample code is in ImGui::ShowDemoWindow()! You can browse its code to learn more about Dear ImGui!).
 
+		RefreshTraceFiles();
 		DrawFrame(io.DisplaySize.x, io.DisplaySize.y);
 		//ImGui::ShowDemoWindow(nullptr);
 
@@ -10,7 +10,7 @@ symbols "On"
 nativewchar "On"
 editandcontinue "On"
 language "C++"
-cppdialect "C++11"
+cppdialect "C++14"
 platforms {"x64"}
 
 debugdir "."
@@ -145,3 +145,27 @@ project "imgui"
 		"imgui/examples/imgui_impl_opengl3.cpp",
 		"imgui/examples/libs/gl3w/GL/gl3w.c"
 	}
+
+-- the capture side as a library to link into your program, define
+-- TRACE_PROFILER (and any TRACE_* modes) there too.
+project "TraceProfiler"
+	kind "StaticLib"
+	files { "TraceProfiler.cpp", "TraceProfiler.h" }
+	defines { "TRACE_PROFILER", "BUILDING_TRACE_PROFILER" }
+
+-- capture path microbenchmarks, see TraceBench.cpp
+function trace_bench_project(name, bench_defines)
+	project(name)
+		kind "ConsoleApp"
+		files { "TraceBench.cpp", "TraceProfiler.cpp" }
+		defines { "TRACE_PROFILER" }
+		defines(bench_defines)
+		filter {"system:linux"}
+			links {"pthread"}
+		filter {}
+end
+
+trace_bench_project("TraceBench", {})
+trace_bench_project("TraceBenchCompact", {"TRACE_COMPACT_EVENTS"})
+trace_bench_project("TraceBenchInline", {"TRACE_INLINE"})
+trace_bench_project("TraceBenchAggregate", {"TRACE_AGGREGATE"})